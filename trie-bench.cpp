@@ -0,0 +1,505 @@
+#include "trie.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Benchmark of trie with wall clock latency of every operation. Results are
+// written to stdout as one JSON object, so runs of two versions can be
+// compared by a script.
+#define DICT "dict.txt"
+#define IMAGE "trie-bench.img"
+#define N_KEYS 1000000
+#define N_QUERIES 2000000
+#define ZIPF_S 0.99
+// Appended to a key to make a miss, never generated in a key.
+#define MISS_WORD '\x01'
+
+using namespace std;
+
+struct Options {
+    const char *keys;      // dict, url, ip, cjk or random
+    const char *dict;
+    unsigned long n_keys;
+    unsigned long n_queries;
+    unsigned long n_warmup;
+    bool zipf;
+    double zipf_s;
+    double miss_ratio;
+    unsigned min_len;      // of random keys
+    unsigned max_len;
+    unsigned long seed;
+    bool reserve;          // room for all keys before insert
+};
+
+struct Result {
+    string name;
+    unsigned long n_ops;
+    double seconds;
+    bool timed_each;       // every operation timed; percentiles are null if not
+    double mean;
+    double p50;
+    double p99;
+    double p999;
+};
+
+// xorshift64*, so runs with the same seed are the same everywhere.
+static unsigned long long g_state = 1;
+
+static void seed_random(unsigned long long seed)
+{
+    g_state = seed ? seed : 1;
+}
+
+static unsigned long long next_random(void)
+{
+    g_state ^= g_state >> 12;
+    g_state ^= g_state << 25;
+    g_state ^= g_state >> 27;
+    return g_state * 2685821657736338717ULL;
+}
+
+static unsigned long random_below(unsigned long n)
+{
+    return (unsigned long)(next_random() % n);
+}
+
+static double random_unit(void)
+{
+    return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static string random_word(unsigned min_len, unsigned max_len)
+{
+    unsigned len = min_len + random_below(max_len - min_len + 1);
+    string word;
+    for (unsigned i = 0; i < len; i++) {
+        word += (char)('a' + random_below(26));
+    }
+    return word;
+}
+
+// Few hosts and path words, so keys share long prefixes as real URLs do.
+static string make_url(void)
+{
+    static const char *schemes[] = { "http://", "https://" };
+    static const char *tlds[] = { ".com", ".org", ".net", ".cn", ".io" };
+    string url = schemes[random_below(2)];
+    url += "www.";
+    // Host names come from their own generator, seeded by host number.
+    unsigned long long host = 1 + random_below(1000);
+    unsigned long long state = g_state;
+    seed_random(host * 0x9e3779b97f4a7c15ULL);
+    url += random_word(3, 12);
+    g_state = state;
+    url += tlds[host % 5];
+    unsigned n_dirs = 1 + random_below(4);
+    for (unsigned i = 0; i < n_dirs; i++) {
+        url += '/';
+        url += random_word(2, 10);
+    }
+    char id[32];
+    snprintf(id, sizeof id, "/%lu.html", random_below(100000));
+    return url + id;
+}
+
+static string make_ip(void)
+{
+    char ip[32];
+    snprintf(ip, sizeof ip, "%lu.%lu.%lu.%lu", 1 + random_below(223),
+             random_below(256), random_below(256), random_below(256));
+    return ip;
+}
+
+// 2 to 4 characters out of the 3000 most used CJK block code points.
+static string make_cjk(void)
+{
+    string key;
+    unsigned n = 2 + random_below(3);
+    for (unsigned i = 0; i < n; i++) {
+        unsigned c = 0x4e00 + random_below(3000);
+        key += (char)(0xe0 | (c >> 12));
+        key += (char)(0x80 | ((c >> 6) & 0x3f));
+        key += (char)(0x80 | (c & 0x3f));
+    }
+    return key;
+}
+
+static bool load_dict(const char *fname, vector<string>& keys)
+{
+    ifstream dict_file(fname);
+    if (!dict_file.is_open()) {
+        return false;
+    }
+    string line;
+    while (getline(dict_file, line)) {
+        keys.push_back(line);
+    }
+    return true;
+}
+
+// Distinct keys in random order.
+static bool make_keys(const Options& options, vector<string>& keys)
+{
+    if (!strcmp(options.keys, "dict")) {
+        if (!load_dict(options.dict, keys)) {
+            return false;
+        }
+        sort(keys.begin(), keys.end());
+        keys.erase(unique(keys.begin(), keys.end()), keys.end());
+    } else {
+        // Generate the missing ones again after duplicates are dropped,
+        // a few rounds at most, as small key spaces may be exhausted.
+        for (int round = 0; round < 4 && keys.size() < options.n_keys; round++) {
+            for (size_t i = keys.size(); i < options.n_keys; i++) {
+                if (!strcmp(options.keys, "url")) {
+                    keys.push_back(make_url());
+                } else if (!strcmp(options.keys, "ip")) {
+                    keys.push_back(make_ip());
+                } else if (!strcmp(options.keys, "cjk")) {
+                    keys.push_back(make_cjk());
+                } else if (!strcmp(options.keys, "random")) {
+                    keys.push_back(random_word(options.min_len, options.max_len));
+                } else {
+                    return false;
+                }
+            }
+            sort(keys.begin(), keys.end());
+            keys.erase(unique(keys.begin(), keys.end()), keys.end());
+        }
+    }
+    for (size_t i = keys.size(); i > 1; i--) {
+        swap(keys[i - 1], keys[random_below(i)]);
+    }
+    return true;
+}
+
+// Key numbers of queries: uniform, or Zipfian by rank in random key order.
+static void make_queries(const Options& options, size_t n_keys,
+                         vector<size_t>& queries, vector<bool>& misses)
+{
+    vector<double> cdf;
+    if (options.zipf) {
+        cdf.resize(n_keys);
+        double sum = 0;
+        for (size_t i = 0; i < n_keys; i++) {
+            sum += 1.0 / pow((double)(i + 1), options.zipf_s);
+            cdf[i] = sum;
+        }
+        for (size_t i = 0; i < n_keys; i++) {
+            cdf[i] /= sum;
+        }
+    }
+    queries.resize(options.n_warmup + options.n_queries);
+    misses.resize(queries.size());
+    for (size_t i = 0; i < queries.size(); i++) {
+        if (options.zipf) {
+            queries[i] = lower_bound(cdf.begin(), cdf.end(), random_unit()) -
+                         cdf.begin();
+            if (queries[i] >= n_keys) {
+                queries[i] = n_keys - 1;
+            }
+        } else {
+            queries[i] = random_below(n_keys);
+        }
+        misses[i] = random_unit() < options.miss_ratio;
+    }
+}
+
+static void summarize(Result *result, vector<double>& ns)
+{
+    result->n_ops = ns.size();
+    result->timed_each = true;
+    if (ns.empty()) {
+        result->mean = result->p50 = result->p99 = result->p999 = 0;
+        return;
+    }
+    double sum = 0;
+    for (size_t i = 0; i < ns.size(); i++) {
+        sum += ns[i];
+    }
+    result->mean = sum / ns.size();
+    sort(ns.begin(), ns.end());
+    result->p50 = ns[(size_t)(ns.size() * 0.5)];
+    result->p99 = ns[(size_t)(ns.size() * 0.99)];
+    result->p999 = ns[(size_t)(ns.size() * 0.999)];
+}
+
+static void print_string(const string& s)
+{
+    cout << '"';
+    for (size_t i = 0; i < s.size(); i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            cout << '\\' << c;
+        } else if (c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof escaped, "\\u%04x", c);
+            cout << escaped;
+        } else {
+            cout << c;
+        }
+    }
+    cout << '"';
+}
+
+static void usage(const char *name)
+{
+    cerr << "Usage: " << name << " [options]" << endl
+         << "  -k KEYS   dict, url, ip, cjk or random (dict)" << endl
+         << "  -f FILE   dictionary for dict keys (" << DICT << ")" << endl
+         << "  -n N      number of generated keys (" << N_KEYS << ")" << endl
+         << "  -l MIN:MAX  length of random keys (4:16)" << endl
+         << "  -q N      number of timed queries (" << N_QUERIES << ")" << endl
+         << "  -w N      number of warmup queries (q / 10)" << endl
+         << "  -z S      Zipfian queries with exponent S (" << ZIPF_S
+         << " if S is 0), uniform by default" << endl
+         << "  -m RATIO  ratio of queries which miss (0)" << endl
+         << "  -s SEED   random seed (1)" << endl
+         << "  -r        reserve room for all keys before insert" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    Options options = { "dict", DICT, N_KEYS, N_QUERIES, (unsigned long)-1,
+                        false, ZIPF_S, 0, 4, 16, 1, false };
+    int opt;
+    while ((opt = getopt(argc, argv, "k:f:n:l:q:w:z:m:s:rh")) != -1) {
+        switch (opt) {
+        case 'k': options.keys = optarg; break;
+        case 'f': options.dict = optarg; break;
+        case 'n': options.n_keys = strtoul(optarg, NULL, 10); break;
+        case 'l':
+            if (sscanf(optarg, "%u:%u", &options.min_len, &options.max_len) != 2 ||
+                !options.min_len || options.min_len > options.max_len) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'q': options.n_queries = strtoul(optarg, NULL, 10); break;
+        case 'w': options.n_warmup = strtoul(optarg, NULL, 10); break;
+        case 'z':
+            options.zipf = true;
+            options.zipf_s = atof(optarg) > 0 ? atof(optarg) : ZIPF_S;
+            break;
+        case 'm': options.miss_ratio = atof(optarg); break;
+        case 's': options.seed = strtoul(optarg, NULL, 10); break;
+        case 'r': options.reserve = true; break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (options.n_warmup == (unsigned long)-1) {
+        options.n_warmup = options.n_queries / 10;
+    }
+
+    seed_random(options.seed);
+    vector<string> keys;
+    if (!make_keys(options, keys) || keys.empty()) {
+        cerr << "No keys: " << options.keys << endl;
+        usage(argv[0]);
+        return -1;
+    }
+    size_t n_keys = keys.size();
+    size_t n_key_words = 0;
+    for (size_t i = 0; i < n_keys; i++) {
+        n_key_words += keys[i].size() + 1;
+    }
+    vector<size_t> queries;
+    vector<bool> misses;
+    make_queries(options, n_keys, queries, misses);
+
+    // Cost of reading the clock, which every latency below includes.
+    double timer_begin = now(), timer_end = timer_begin;
+    for (int i = 0; i < 1000; i++) {
+        timer_end = now();
+    }
+    double timer_ns = (timer_end - timer_begin) * 1e9 / 1000;
+
+    vector<Result> results;
+    vector<double> ns;
+    Result result;
+    double begin, end, last;
+    Data data;
+
+    Trie trie;
+    ns.reserve(max(n_keys, queries.size()));
+    result.name = "insert";
+    begin = last = now();
+    if (options.reserve) {
+        trie.reserve(n_keys, n_key_words);
+    }
+    for (size_t i = 0; i < n_keys; i++) {
+        trie.insert((Word *)keys[i].c_str(), keys[i].size() + 1, (Data)i + 1);
+        end = now();
+        ns.push_back((end - last) * 1e9);
+        last = end;
+    }
+    result.seconds = last - begin;
+    summarize(&result, ns);
+    results.push_back(result);
+    TrieStats stats = trie.stats();
+
+    // Misses are keys followed by a word no key has, so they go all the way
+    // down before failing.
+    vector<string> missed(n_keys);
+    vector<const string *> query_keys(queries.size());
+    for (size_t i = 0; i < queries.size(); i++) {
+        if (misses[i] && missed[queries[i]].empty()) {
+            missed[queries[i]] = keys[queries[i]] + MISS_WORD;
+        }
+        query_keys[i] = misses[i] ? &missed[queries[i]] : &keys[queries[i]];
+    }
+    size_t n_found = 0;
+    ns.clear();
+    result.name = "search";
+    for (size_t i = 0; i < options.n_warmup && i < queries.size(); i++) {
+        const string& query = *query_keys[i];
+        n_found += trie.search((Word *)query.c_str(), query.size() + 1, &data);
+    }
+    n_found = 0;
+    begin = last = now();
+    for (size_t i = options.n_warmup; i < queries.size(); i++) {
+        const string& query = *query_keys[i];
+        n_found += trie.search((Word *)query.c_str(), query.size() + 1, &data);
+        end = now();
+        ns.push_back((end - last) * 1e9);
+        last = end;
+    }
+    result.seconds = last - begin;
+    summarize(&result, ns);
+    results.push_back(result);
+
+    ns.clear();
+    result.name = "common_prefix_search";
+    Index n_prefix_keys = 0;
+    begin = last = now();
+    for (size_t i = options.n_warmup; i < queries.size(); i++) {
+        const string& key = keys[queries[i]];
+        Match matches[16];
+        n_prefix_keys += trie.common_prefix_search((Word *)key.c_str(), key.size() + 1, '\0',
+                                                   matches, 16);
+        end = now();
+        ns.push_back((end - last) * 1e9);
+        last = end;
+    }
+    result.seconds = last - begin;
+    summarize(&result, ns);
+    results.push_back(result);
+
+    MemoryUsage usage = trie.memory_usage();
+    struct stat st;
+    long long image_size = 0;
+    if (trie.save(IMAGE) && !stat(IMAGE, &st)) {
+        image_size = st.st_size;
+    }
+    unlink(IMAGE);
+
+    ns.clear();
+    result.name = "erase";
+    begin = last = now();
+    for (size_t i = 0; i < n_keys; i++) {
+        trie.erase((Word *)keys[i].c_str(), keys[i].size() + 1);
+        end = now();
+        ns.push_back((end - last) * 1e9);
+        last = end;
+    }
+    result.seconds = last - begin;
+    summarize(&result, ns);
+    results.push_back(result);
+
+    // build() takes all keys at once, so it has a total time only, and no
+    // percentiles.
+    vector<string> sorted(keys);
+    sort(sorted.begin(), sorted.end());
+    vector<const Word *> key_words(n_keys);
+    vector<Index> n_words(n_keys);
+    vector<Data> key_data(n_keys);
+    for (size_t i = 0; i < n_keys; i++) {
+        key_words[i] = (const Word *)sorted[i].c_str();
+        n_words[i] = sorted[i].size() + 1;
+        key_data[i] = (Data)i + 1;
+    }
+    Trie built;
+    begin = now();
+    built.build(&key_words[0], &n_words[0], &key_data[0], n_keys);
+    end = now();
+    result.name = "build";
+    result.seconds = end - begin;
+    result.n_ops = n_keys;
+    result.timed_each = false;
+    result.mean = result.seconds * 1e9 / n_keys;
+    results.push_back(result);
+
+    cout.precision(6);
+    cout << "{" << endl;
+    cout << "  \"keys\": ";
+    print_string(options.keys);
+    cout << "," << endl;
+    cout << "  \"n_keys\": " << n_keys << "," << endl;
+    cout << "  \"key_bytes\": " << n_key_words << "," << endl;
+    cout << "  \"distribution\": \"" << (options.zipf ? "zipf" : "uniform") << "\"," << endl;
+    if (options.zipf) {
+        cout << "  \"zipf_s\": " << options.zipf_s << "," << endl;
+    }
+    cout << "  \"miss_ratio\": " << options.miss_ratio << "," << endl;
+    cout << "  \"seed\": " << options.seed << "," << endl;
+    cout << "  \"reserved\": " << (options.reserve ? "true" : "false") << "," << endl;
+    cout << "  \"timer_ns\": " << timer_ns << "," << endl;
+    cout << "  \"n_warmup\": " << options.n_warmup << "," << endl;
+    cout << "  \"hits\": " << n_found << "," << endl;
+    cout << "  \"prefix_keys\": " << n_prefix_keys << "," << endl;
+    cout << "  \"density\": " << usage.density << "," << endl;
+    cout << "  \"memory_bytes\": " << usage.total_bytes << "," << endl;
+    cout << "  \"memory_bytes_per_key\": " << (double)usage.total_bytes / n_keys << "," << endl;
+    cout << "  \"unused_bytes\": " << usage.unused_bytes << "," << endl;
+    cout << "  \"average_tail_words\": " << usage.average_tail_words << "," << endl;
+    cout << "  \"image_bytes\": " << image_size << "," << endl;
+    cout << "  \"image_bytes_per_key\": " << (double)image_size / n_keys << "," << endl;
+    // All zeros unless trie.cpp is built with TRIE_STATS.
+    cout << "  \"insert_stats\": {\"enabled\": " << (stats.enabled ? "true" : "false")
+         << ", \"collisions\": " << stats.collisions
+         << ", \"relocations\": " << stats.relocations
+         << ", \"relocated_nodes\": " << stats.relocated_nodes
+         << ", \"find_bases\": " << stats.find_bases
+         << ", \"base_probes\": " << stats.base_probes
+         << ", \"base_fallbacks\": " << stats.base_fallbacks
+         << ", \"node_growths\": " << stats.node_growths
+         << ", \"tail_growths\": " << stats.tail_growths
+         << ", \"tail_word_growths\": " << stats.tail_word_growths
+         << ", \"tail_splits\": " << stats.tail_splits << "}," << endl;
+    cout << "  \"phases\": [" << endl;
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        cout << "    {\"name\": \"" << r.name << "\", \"ops\": " << r.n_ops
+             << ", \"seconds\": " << r.seconds
+             << ", \"ops_per_sec\": " << (r.seconds > 0 ? r.n_ops / r.seconds : 0)
+             << ", \"ns_per_op\": {\"mean\": " << r.mean;
+        if (r.timed_each) {
+            cout << ", \"p50\": " << r.p50 << ", \"p99\": " << r.p99
+                 << ", \"p999\": " << r.p999;
+        } else {
+            cout << ", \"p50\": null, \"p99\": null, \"p999\": null";
+        }
+        cout << "}}" << (i + 1 < results.size() ? "," : "") << endl;
+    }
+    cout << "  ]" << endl;
+    cout << "}" << endl;
+
+    return 0;
+}
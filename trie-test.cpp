@@ -3,15 +3,114 @@
 #include <csignal>
 #include <fstream>
 #include <iostream>
+#include <pthread.h>
 #include <string>
+#include <unistd.h>
 
 // Every line should be different in this test.
 #define DICT "dict.txt"
+#define IMAGE "dict.img"
+#define N_READERS 4
+#define PUBLISH_INTERVAL 65536
+#define TOP_K 10
 
 using namespace std;
 
 bool g_exit = false;
 int g_rand = 0;
+bool g_writing = false;
+
+struct Reader {
+    ConcurrentTrie *trie;
+    vector<string> *dict;
+    unsigned long n_searched;
+    unsigned long n_found;
+    bool error;
+};
+
+struct Walk {
+    string last;
+    unsigned long n_keys;
+    bool error;
+};
+
+bool count_key(const Word words[], Index n_words, Data data, void *arg)
+{
+    Walk *walk = (Walk *)arg;
+    string key((const char *)words, n_words);
+    if (!data || (walk->n_keys && key <= walk->last)) {
+        walk->error = true;
+        return false;
+    }
+    walk->last = key;
+    walk->n_keys++;
+    return true;
+}
+
+bool max_data(const Word words[], Index n_words, Data data, void *arg)
+{
+    Data *max = (Data *)arg;
+    if (data > *max) {
+        *max = data;
+    }
+    return true;
+}
+
+struct Best {
+    Index n_keys;
+    Data data[TOP_K];
+};
+
+bool add_best(const Word words[], Index n_words, Data data, void *arg)
+{
+    Best *best = (Best *)arg;
+    best->data[best->n_keys++] = data;
+    return true;
+}
+
+struct Fuzzy {
+    string key;
+    unsigned long n_keys;
+    unsigned long n_same;
+    bool error;
+};
+
+bool check_edits(const Word words[], Index n_words, Index n_edits, Data data, void *arg)
+{
+    Fuzzy *fuzzy = (Fuzzy *)arg;
+    string key((const char *)words, n_words);
+    Index n_diffs = 0;
+    for (size_t i = 0; i < key.size() && key.size() == fuzzy->key.size(); i++) {
+        n_diffs += key[i] != fuzzy->key[i];
+    }
+    if (key.size() != fuzzy->key.size() || n_diffs != n_edits || n_edits > 1) {
+        fuzzy->error = true;
+        return false;
+    }
+    fuzzy->n_same += !n_edits;
+    fuzzy->n_keys++;
+    return true;
+}
+
+struct Scan {
+    Trie *trie;
+    const string *text;
+    unsigned long n_keys;
+    bool error;
+};
+
+bool check_key(long long end, Index n_words, Data data, void *arg)
+{
+    Scan *scan = (Scan *)arg;
+    string key = scan->text->substr(end - n_words, n_words);
+    Data expected;
+    if (!scan->trie->search((const Word *)key.c_str(), key.size() + 1, &expected) || data != expected) {
+        scan->error = true;
+        return false;
+    }
+    scan->n_keys++;
+    return true;
+}
 
 void handle_sigusr1(int sig)
 {
@@ -57,7 +156,7 @@ void test(vector<string>& dict)
     unsigned dict_size = dict.size();
     Trie trie;
     vector<Tail> tails;
-    Index data;
+    Data data;
     unsigned i, j;
     int loop;
 
@@ -71,6 +170,79 @@ void test(vector<string>& dict)
         }
         end = clock();
         cout << "INSERT" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
+        cout << "INSERT DENSITY" << ": " << trie.density() << endl;
+
+        MemoryUsage usage = trie.memory_usage();
+        if (usage.n_used_tails != (Index)dict_size || usage.density != trie.density() ||
+            usage.unused_bytes < 0 || usage.unused_bytes >= usage.total_bytes) {
+            cout << "error: MEMORY USAGE" << ": " << usage.n_used_tails << " tails used, "
+                 << usage.unused_bytes << " of " << usage.total_bytes << " bytes unused" << endl;
+            exit(-2);
+        }
+        cout << "MEMORY USAGE" << ": " << usage.total_bytes << " bytes, "
+             << usage.unused_bytes << " unused" << endl;
+
+        {
+            Index n_words = 0;
+            for (i = 0; i < dict_size; i++) {
+                n_words += dict[i].size() + 1;
+            }
+            Trie reserved;
+            reserved.reserve(dict_size, n_words);
+            MemoryUsage before = reserved.memory_usage();
+            Trie chunked;
+            chunked.set_growth(1, 4096);
+            begin = clock();
+            for (i = 0; i < dict_size; i++) {
+                reserved.insert((Word *)dict[i].c_str(), dict[i].size() + 1, i + 1);
+                chunked.insert((Word *)dict[i].c_str(), dict[i].size() + 1, i + 1);
+            }
+            end = clock();
+            MemoryUsage after = reserved.memory_usage();
+            if (after.n_tails != before.n_tails || after.n_tail_words != before.n_tail_words) {
+                cout << "error: RESERVE" << ": " << "tails grown from " << before.n_tails << " to " << after.n_tails
+                     << ", tail words from " << before.n_tail_words << " to " << after.n_tail_words << endl;
+                exit(-2);
+            }
+            for (i = 0; i < dict_size; i++) {
+                if (!reserved.search((Word *)dict[i].c_str(), dict[i].size() + 1, &data) || data != (Data)i + 1 ||
+                    !chunked.search((Word *)dict[i].c_str(), dict[i].size() + 1, &data) || data != (Data)i + 1) {
+                    cout << "error: RESERVE" << ": " << dict[i] << " not found" << endl;
+                    exit(-2);
+                }
+            }
+            cout << "RESERVE" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms, "
+                 << before.n_nodes << " => " << after.n_nodes << " cells" << endl;
+        }
+
+        {
+            vector<string> sorted_dict(dict);
+            sort(sorted_dict.begin(), sorted_dict.end());
+            vector<const Word *> keys(dict_size);
+            vector<Index> n_words(dict_size);
+            vector<Data> values(dict_size);
+            for (i = 0; i < dict_size; i++) {
+                keys[i] = (Word *)sorted_dict[i].c_str();
+                n_words[i] = sorted_dict[i].size() + 1;
+                values[i] = i + 1;
+            }
+            Trie built;
+            begin = clock();
+            built.build(&keys[0], &n_words[0], &values[0], dict_size);
+            end = clock();
+            cout << "BUILD" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
+            cout << "BUILD DENSITY" << ": " << built.density() << endl;
+            for (i = 0; i < dict_size; i++) {
+                if (!built.search(keys[i], n_words[i], &data)) {
+                    cout << "error: BUILD" << ": " << sorted_dict[i] << " not found" << endl;
+                    exit(-2);
+                }
+                if (data != (Data)i + 1) {
+                    cout << "error: BUILD" << ": " << sorted_dict[i] << " data changed: " << i << "=>" << data << endl;
+                    exit(-2);
+                }
+            }
+        }
 
         begin = clock();
         for (i = 0; i < dict_size; i++) {
@@ -78,7 +250,7 @@ void test(vector<string>& dict)
                 cout << "error: SEARCH DATA" << ": " << dict[i] << " not found" << endl;
                 exit(-2);
             }
-            if (data != (Index)i + 1) {
+            if (data != (Data)i + 1) {
                 cout << "error: SEARCH DATA" << ": " << dict[i] << " data changed: " << i << "=>" << data << endl;
                 exit(-2);
             }
@@ -86,6 +258,113 @@ void test(vector<string>& dict)
         end = clock();
         cout << "SEARCH DATA" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
 
+        {
+            vector<const Word *> keys(dict_size);
+            vector<Index> n_words(dict_size);
+            vector<Data> datas(dict_size);
+            bool *found = new bool[dict_size];
+            for (i = 0; i < dict_size; i++) {
+                keys[i] = (Word *)dict[i].c_str();
+                n_words[i] = dict[i].size() + 1;
+            }
+            begin = clock();
+            trie.search_batch(&keys[0], &n_words[0], dict_size, &datas[0], found);
+            end = clock();
+            for (i = 0; i < dict_size; i++) {
+                if (!found[i]) {
+                    cout << "error: SEARCH BATCH" << ": " << dict[i] << " not found" << endl;
+                    exit(-2);
+                }
+                if (datas[i] != (Data)i + 1) {
+                    cout << "error: SEARCH BATCH" << ": " << dict[i] << " data changed: " << i << "=>" << datas[i] << endl;
+                    exit(-2);
+                }
+            }
+            delete[] found;
+            cout << "SEARCH BATCH" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
+        }
+
+        begin = clock();
+        trie.compact();
+        end = clock();
+        cout << "COMPACT" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
+        for (i = 0; i < dict_size; i++) {
+            if (!trie.search((Word *)dict[i].c_str(), dict[i].size() + 1, &data)) {
+                cout << "error: COMPACT" << ": " << dict[i] << " not found" << endl;
+                exit(-2);
+            }
+            if (data != (Data)i + 1) {
+                cout << "error: COMPACT" << ": " << dict[i] << " data changed: " << i << "=>" << data << endl;
+                exit(-2);
+            }
+        }
+
+        begin = clock();
+        if (!trie.save(IMAGE)) {
+            cout << "error: SAVE" << ": " << IMAGE << " not saved" << endl;
+            exit(-2);
+        }
+        end = clock();
+        cout << "SAVE" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
+
+        {
+            Trie mapped;
+            // Counts of these keys must be gone once the image is opened.
+            for (i = 0; i < dict_size && i < 1000; i++) {
+                mapped.insert((Word *)dict[i].c_str(), dict[i].size() + 1, (Data)i + 1);
+            }
+            begin = clock();
+            if (!mapped.open_mapped(IMAGE)) {
+                cout << "error: OPEN MAPPED" << ": " << IMAGE << " not opened" << endl;
+                exit(-2);
+            }
+            end = clock();
+            cout << "OPEN MAPPED" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
+            TrieStats stats = mapped.stats();
+            if (stats.collisions || stats.relocations || stats.relocated_nodes ||
+                stats.find_bases || stats.base_probes || stats.base_fallbacks ||
+                stats.node_growths || stats.tail_growths ||
+                stats.tail_word_growths || stats.tail_splits) {
+                cout << "error: STATS MAPPED" << ": " << stats.find_bases << " bases looked for" << endl;
+                exit(-2);
+            }
+            usage = mapped.memory_usage();
+            // Sibling lists are mapped too, so cells take as much as in trie.
+            if (!usage.mapped || usage.n_used_tails != (Index)dict_size ||
+                usage.density != mapped.density() ||
+                usage.node_bytes != trie.memory_usage().node_bytes) {
+                cout << "error: MEMORY USAGE MAPPED" << ": " << usage.n_used_tails << " tails used" << endl;
+                exit(-2);
+            }
+
+            begin = clock();
+            for (i = 0; i < dict_size; i++) {
+                if (!mapped.search((Word *)dict[i].c_str(), dict[i].size() + 1, &data)) {
+                    cout << "error: SEARCH MAPPED" << ": " << dict[i] << " not found" << endl;
+                    exit(-2);
+                }
+                if (data != (Data)i + 1) {
+                    cout << "error: SEARCH MAPPED" << ": " << dict[i] << " data changed: " << i << "=>" << data << endl;
+                    exit(-2);
+                }
+            }
+            end = clock();
+            cout << "SEARCH MAPPED" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
+
+            tails.clear();
+            mapped.prefix(NULL, 0, tails);
+            if (tails.size() != dict_size) {
+                cout << "error: SEARCH ALL MAPPED" << ": " << "size changed: " << dict_size << "=>" << tails.size() << endl;
+                exit(-2);
+            }
+            for (j = 0; j < tails.size(); j++) {
+                if (tails[j].n_words) {
+                    free(tails[j].words);
+                }
+            }
+        }
+        unlink(IMAGE);
+
         set_random(clock());
         sort(dict.begin(), dict.end(), random_sort);
 
@@ -126,6 +405,60 @@ void test(vector<string>& dict)
             }
         }
 
+        Walk walk;
+        walk.n_keys = 0;
+        walk.error = false;
+        begin = clock();
+        trie.for_each_prefix(NULL, 0, count_key, &walk);
+        end = clock();
+        if (walk.error || walk.n_keys != dict_size) {
+            cout << "error: FOR EACH PREFIX" << ": " << walk.n_keys << " keys, " << dict_size << " expected" << endl;
+            exit(-2);
+        }
+        cout << "FOR EACH PREFIX" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
+
+        begin = clock();
+        {
+            PrefixIterator iter(trie, NULL, 0);
+            const Word *words;
+            Index n_words;
+            walk.n_keys = 0;
+            while (iter.next(&words, &n_words, &data)) {
+                if (!count_key(words, n_words, data, &walk)) {
+                    break;
+                }
+            }
+        }
+        end = clock();
+        if (walk.error || walk.n_keys != dict_size) {
+            cout << "error: PREFIX ITERATOR" << ": " << walk.n_keys << " keys, " << dict_size << " expected" << endl;
+            exit(-2);
+        }
+        cout << "PREFIX ITERATOR" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
+
+        clock_t top_k_time = 0;
+        for (i = 0; i < dict_size; i += 97) {
+            Index n_prefix = dict[i].size() < 2 ? dict[i].size() : 2;
+            Best best;
+            best.n_keys = 0;
+            begin = clock();
+            trie.top_k((Word *)dict[i].c_str(), n_prefix, TOP_K, add_best, &best);
+            top_k_time += clock() - begin;
+            Data max = 0;
+            trie.for_each_prefix((Word *)dict[i].c_str(), n_prefix, max_data, &max);
+            if (!best.n_keys || best.data[0] != max) {
+                cout << "error: TOP K" << ": " << dict[i] << " best data: " << max << "=>" << (best.n_keys ? best.data[0] : 0) << endl;
+                exit(-2);
+            }
+            for (j = 1; j < (unsigned)best.n_keys; j++) {
+                if (best.data[j] > best.data[j - 1]) {
+                    cout << "error: TOP K" << ": " << dict[i] << " not in descending order" << endl;
+                    exit(-2);
+                }
+            }
+        }
+        cout << "TOP K" << ": " << top_k_time * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
+
         begin = clock();
         for (i = 0; i < dict_size; i++) {
             tails.clear();
@@ -155,12 +488,199 @@ void test(vector<string>& dict)
         end = clock();
         cout << "SEARCH PREFIX" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
 
+        begin = clock();
+        for (i = 0; i < dict_size; i++) {
+            Match matches[2];
+            trie.search((Word *)dict[i].c_str(), dict[i].size() + 1, &data);
+            string text = dict[i] + dict[(i + 1) % dict_size];
+            if (trie.common_prefix_search((Word *)text.data(), text.size(), '\0', matches, 2) != 1 ||
+                matches[0].n_words != (Index)dict[i].size() || matches[0].data != data) {
+                cout << "error: COMMON PREFIX SEARCH" << ": " << dict[i] << " not found" << endl;
+                exit(-2);
+            }
+        }
+        end = clock();
+        cout << "COMMON PREFIX SEARCH" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
+
+        // All keys have 4 letters, so each of them has 4 * 25 others one
+        // substitution away and none one insertion or deletion away.
+        begin = clock();
+        for (i = 0; i < dict_size; i += 97) {
+            Fuzzy fuzzy = { string(dict[i].c_str(), dict[i].size() + 1), 0, 0, false };
+            trie.fuzzy_search((Word *)fuzzy.key.data(), fuzzy.key.size(), 1, check_edits, &fuzzy);
+            if (fuzzy.error || fuzzy.n_keys != 101 || fuzzy.n_same != 1) {
+                cout << "error: FUZZY SEARCH" << ": " << dict[i] << " " << fuzzy.n_keys << " keys found" << endl;
+                exit(-2);
+            }
+        }
+        end = clock();
+        cout << "FUZZY SEARCH" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
+
+        begin = clock();
+        {
+            Cursor cursor(trie);
+            const Word *key;
+            Index n_key_words;
+            string last;
+            for (i = 0, j = cursor.first(); j; i++, j = cursor.next()) {
+                cursor.get(&key, &n_key_words, &data);
+                string s((const char *)key, n_key_words);
+                if (i && s <= last) {
+                    cout << "error: CURSOR" << ": " << s.c_str() << " after " << last.c_str() << endl;
+                    exit(-2);
+                }
+                last = s;
+            }
+            if (i != dict_size) {
+                cout << "error: CURSOR" << ": " << i << " keys, " << dict_size << " expected" << endl;
+                exit(-2);
+            }
+            for (i = 0; i < dict_size; i += 97) {
+                // A key without its end word is less than it and greater
+                // than all keys before it.
+                string s = dict[i] + '\0';
+                trie.search((Word *)s.data(), s.size(), &data);
+                Data found = 0;
+                if (!cursor.lower_bound((Word *)dict[i].data(), dict[i].size()) ||
+                    !cursor.get(&key, &n_key_words, &found) || found != data ||
+                    string((const char *)key, n_key_words) != s ||
+                    (cursor.upper_bound((Word *)s.data(), s.size()) &&
+                     (!cursor.prev() || !cursor.get(&key, &n_key_words, &found) || found != data)) ||
+                    !cursor.range((Word *)dict[i].data(), dict[i].size(), (Word *)s.data(), s.size() + 1) ||
+                    cursor.next() || !cursor.range(NULL, 0, NULL, 0)) {
+                    cout << "error: CURSOR" << ": " << dict[i] << " not found" << endl;
+                    exit(-2);
+                }
+            }
+        }
+        end = clock();
+        cout << "CURSOR" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
+
+        begin = clock();
+        for (i = 0; i < dict_size; i += 97) {
+            Word key[8];
+            Data found = 0;
+            trie.search((Word *)dict[i].c_str(), dict[i].size() + 1, &data);
+            Index handle = trie.handle((Word *)dict[i].c_str(), dict[i].size() + 1);
+            if (handle < 0 || trie.key_of(handle, key, sizeof key, &found) != (Index)dict[i].size() + 1 ||
+                string((const char *)key, dict[i].size() + 1) != string(dict[i].c_str(), dict[i].size() + 1) || found != data) {
+                cout << "error: KEY OF" << ": " << dict[i] << " not found by handle " << handle << endl;
+                exit(-2);
+            }
+        }
+        end = clock();
+        cout << "KEY OF" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
+
+        // Keys are all strings of 4 letters, so the number of a key is the
+        // key read as a number in base 26.
+        begin = clock();
+        trie.build_ranks();
+        for (i = 0; i < dict_size; i += 97) {
+            Index ordinal = 0;
+            for (j = 0; j < dict[i].size(); j++) {
+                ordinal = ordinal * 26 + dict[i][j] - 'a';
+            }
+            Word key[8];
+            Data found = 0;
+            trie.search((Word *)dict[i].c_str(), dict[i].size() + 1, &data);
+            if (trie.rank((Word *)dict[i].c_str(), dict[i].size() + 1) != ordinal ||
+                trie.key_at(ordinal, key, sizeof key, &found) != (Index)dict[i].size() + 1 ||
+                string((const char *)key, dict[i].size() + 1) != string(dict[i].c_str(), dict[i].size() + 1) || found != data) {
+                cout << "error: RANK" << ": " << dict[i] << " not numbered " << ordinal << endl;
+                exit(-2);
+            }
+        }
+        end = clock();
+        cout << "RANK" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
+
+        {
+            // Keys with a Chinese character, which is not a key, after
+            // every 10 of them.
+            string text;
+            vector<Token> expected;
+            for (i = 0; i < dict_size; i += 7) {
+                trie.search((Word *)dict[i].c_str(), dict[i].size() + 1, &data);
+                Token token = { (Index)text.size(), (Index)dict[i].size(), data, true };
+                expected.push_back(token);
+                text += dict[i];
+                if (expected.size() % 11 == 10) {
+                    Token single = { (Index)text.size(), 3, 0, false };
+                    expected.push_back(single);
+                    text += "\xe4\xb8\xad";
+                }
+            }
+            vector<Token> tokens(text.size());
+            SegmentMode modes[] = { FORWARD_MAX_MATCH, BACKWARD_MAX_MATCH, BIDIRECTIONAL_MAX_MATCH };
+            // Every mode keeps the first tokens if there is no room for all.
+            Index max_tokens[] = { (Index)tokens.size(), (Index)expected.size() / 3 };
+            trie.build_reversed('\0');
+            begin = clock();
+            for (j = 0; j < sizeof modes / sizeof modes[0]; j++) {
+                for (unsigned k = 0; k < sizeof max_tokens / sizeof max_tokens[0]; k++) {
+                    Index n_tokens = trie.segment((Word *)text.data(), text.size(), '\0', modes[j], &tokens[0], max_tokens[k]);
+                    if (n_tokens != (Index)expected.size()) {
+                        cout << "error: SEGMENT" << ": " << n_tokens << " tokens, " << expected.size() << " expected" << endl;
+                        exit(-2);
+                    }
+                    for (i = 0; i < expected.size() && i < (unsigned)max_tokens[k]; i++) {
+                        if (tokens[i].begin != expected[i].begin || tokens[i].n_words != expected[i].n_words ||
+                            tokens[i].found != expected[i].found || (tokens[i].found && tokens[i].data != expected[i].data)) {
+                            cout << "error: SEGMENT" << ": " << "token " << i << " at " << tokens[i].begin << " changed" << endl;
+                            exit(-2);
+                        }
+                    }
+                }
+            }
+            end = clock();
+            cout << "SEGMENT" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
+
+            // Every 4 letters in text are a key.
+            unsigned long n_expected = 0;
+            for (i = 0, j = 0; i < text.size(); i++) {
+                j = text[i] >= 'a' && text[i] <= 'z' ? j + 1 : 0;
+                n_expected += j >= 4;
+            }
+            begin = clock();
+            trie.build_links('\0');
+            Scan scan = { &trie, &text, 0, false };
+            ScanState state = { 0, 0 };
+            for (i = 0; i < text.size(); i += text.size() / 3 + 1) {
+                trie.scan((const Word *)text.data() + i, min(text.size() - i, text.size() / 3 + 1), check_key, &scan, &state);
+            }
+            end = clock();
+            if (scan.error || scan.n_keys != n_expected) {
+                cout << "error: SCAN" << ": " << scan.n_keys << " keys, " << n_expected << " expected" << endl;
+                exit(-2);
+            }
+            cout << "SCAN" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
+        }
+
+        begin = clock();
+        Trie *snapshot = trie.snapshot();
+        end = clock();
+        cout << "SNAPSHOT" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
+
         begin = clock();
         for (i = 0; i < dict_size; i++) {
             trie.erase((Word *)dict[i].c_str(), dict[i].size() + 1);
         }
         end = clock();
         cout << "ERASE" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
+        if (trie.memory_usage().n_used_tails || snapshot->memory_usage().n_used_tails != (Index)dict_size) {
+            cout << "error: MEMORY USAGE AFTER ERASE" << ": " << trie.memory_usage().n_used_tails << " tails used" << endl;
+            exit(-2);
+        }
+
+        begin = clock();
+        for (i = 0; i < dict_size; i++) {
+            if (!snapshot->search((Word *)dict[i].c_str(), dict[i].size() + 1)) {
+                cout << "error: SEARCH SNAPSHOT" << ": " << dict[i] << " not found" << endl;
+                exit(-2);
+            }
+        }
+        end = clock();
+        cout << "SEARCH SNAPSHOT" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
+        delete snapshot;
 
         begin = clock();
         for (i = 0; i < dict_size; i++) {
@@ -182,6 +702,48 @@ void test(vector<string>& dict)
         }
         cout << "SEARCH ALL AFTER ERASE" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
 
+        {
+            MemoryUsage before = trie.memory_usage();
+            begin = clock();
+            while (!trie.compact_storage(4096)) {
+            }
+            end = clock();
+            usage = trie.memory_usage();
+            if (usage.n_used_nodes || usage.n_used_tails || usage.total_bytes >= before.total_bytes) {
+                cout << "error: COMPACT STORAGE" << ": " << usage.total_bytes << " of " << before.total_bytes
+                     << " bytes left" << endl;
+                exit(-2);
+            }
+
+            // Queries go on between slices of a half erased trie.
+            Trie half;
+            unsigned n_keys = dict_size / 8;
+            for (i = 0; i < n_keys; i++) {
+                half.insert((Word *)dict[i].c_str(), dict[i].size() + 1, i + 1);
+            }
+            for (i = 1; i < n_keys; i += 2) {
+                half.erase((Word *)dict[i].c_str(), dict[i].size() + 1);
+            }
+            begin = clock();
+            for (j = 0; !half.compact_storage(256); j++) {
+                i = j * 2 % n_keys;
+                if (!half.search((Word *)dict[i].c_str(), dict[i].size() + 1, &data) || data != (Data)i + 1) {
+                    cout << "error: COMPACT STORAGE" << ": " << dict[i] << " not found in slice " << j << endl;
+                    exit(-2);
+                }
+            }
+            end = clock();
+            for (i = 0; i < n_keys; i++) {
+                if (half.search((Word *)dict[i].c_str(), dict[i].size() + 1, &data) != !(i % 2) ||
+                    (!(i % 2) && data != (Data)i + 1)) {
+                    cout << "error: COMPACT STORAGE" << ": " << dict[i] << " changed" << endl;
+                    exit(-2);
+                }
+            }
+            cout << "COMPACT STORAGE" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms, "
+                 << j << " slices, " << half.memory_usage().total_bytes << " bytes" << endl;
+        }
+
         begin = clock();
         trie.erase(NULL, 0);
         end = clock();
@@ -189,6 +751,84 @@ void test(vector<string>& dict)
     }
 }
 
+void *read_concurrently(void *arg)
+{
+    Reader *reader = (Reader *)arg;
+    vector<string>& dict = *reader->dict;
+    unsigned dict_size = dict.size();
+    Data data;
+
+    while (__atomic_load_n(&g_writing, __ATOMIC_ACQUIRE)) {
+        for (unsigned i = 0; i < dict_size; i += 101) {
+            if (reader->trie->search((Word *)dict[i].c_str(), dict[i].size() + 1, &data)) {
+                if (data != (Data)i + 1) {
+                    reader->error = true;
+                }
+                reader->n_found++;
+            }
+            reader->n_searched++;
+        }
+        // Leave CPU to the writer.
+        usleep(10000);
+    }
+    return NULL;
+}
+
+void test_concurrent(vector<string>& dict)
+{
+    clock_t begin, end;
+    unsigned dict_size = dict.size();
+    ConcurrentTrie trie;
+    pthread_t threads[N_READERS];
+    Reader readers[N_READERS];
+    Data data;
+    unsigned i;
+
+    __atomic_store_n(&g_writing, true, __ATOMIC_RELEASE);
+    for (i = 0; i < N_READERS; i++) {
+        readers[i].trie = &trie;
+        readers[i].dict = &dict;
+        readers[i].n_searched = 0;
+        readers[i].n_found = 0;
+        readers[i].error = false;
+        pthread_create(threads + i, NULL, read_concurrently, readers + i);
+    }
+
+    begin = clock();
+    for (i = 0; i < dict_size; i++) {
+        trie.insert((Word *)dict[i].c_str(), dict[i].size() + 1, i + 1);
+        if ((i + 1) % PUBLISH_INTERVAL == 0) {
+            trie.publish();
+        }
+    }
+    trie.publish();
+    end = clock();
+
+    __atomic_store_n(&g_writing, false, __ATOMIC_RELEASE);
+    unsigned long n_searched = 0;
+    for (i = 0; i < N_READERS; i++) {
+        pthread_join(threads[i], NULL);
+        if (readers[i].error) {
+            cout << "error: CONCURRENT SEARCH" << ": " << "data corrupt" << endl;
+            exit(-2);
+        }
+        n_searched += readers[i].n_searched;
+    }
+    cout << "CONCURRENT INSERT" << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms, "
+         << n_searched << " searches by " << N_READERS << " readers" << endl;
+
+    for (i = 0; i < dict_size; i++) {
+        if (!trie.search((Word *)dict[i].c_str(), dict[i].size() + 1, &data)) {
+            cout << "error: CONCURRENT SEARCH" << ": " << dict[i] << " not found" << endl;
+            exit(-2);
+        }
+        if (data != (Data)i + 1) {
+            cout << "error: CONCURRENT SEARCH" << ": " << dict[i] << " data changed: " << i << "=>" << data << endl;
+            exit(-2);
+        }
+    }
+}
+
 int main(void)
 {
     clock_t begin, end;
@@ -206,6 +846,7 @@ int main(void)
     while (!g_exit) {
         begin = clock();
         test(dict);
+        test_concurrent(dict);
         end = clock();
         cout << i << ": " << (end - begin) * 1000.0 / CLOCKS_PER_SEC << "ms" << endl;
         i++;
@@ -6,24 +6,74 @@
 
 
 #include "trie.h"
+#include <algorithm>
 #include <cassert>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <limits>
 #include <stdexcept>
 #include <vector>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-// INC_BASE_WHEN_COLLISION is used to indicate increasing base value when two
-// nodes collision happened, it will be faster (about 2x faster in my test).
-// But it will probably use a little more memory I guess.
-#define INC_BASE_WHEN_COLLISION
-// START_BASE_OPTIMIZATION is used to optimize finding base value.
-// 10x faster then no any optimization but 2x memory occupation in my test.
-#define START_BASE_OPTIMIZATION
-// BTW, how to find base value is significant in Double-Array Trie algorithm.
+// How to find base value is significant in Double-Array Trie algorithm.
+// Free cells are linked in lists threaded through themselves, block by block,
+// so finding a base only tries free cells (see find_base()).
+// Cells in a block, and how many times a block is tried for a node of several
+// sub nodes before it is only used for nodes of 1 sub node.
+// All of these can be given on the command line (see TRIE_FLAGS in Makefile),
+// so strategies can be compared by trie-bench.
+#ifndef BLOCK_SIZE
+#define BLOCK_SIZE 256
+#endif
+#ifndef MAX_TRIALS
+#define MAX_TRIALS 1
+#endif
+// CHILD_INDEX is used to link sub nodes of every node in a sibling list, so
+// walking through sub nodes costs O(sub nodes) instead of 256 probes. It
+// speeds up collision handling, erasing and prefix enumeration, at the cost
+// of 4 bytes per node. Define NO_CHILD_INDEX to leave it out.
+#ifndef NO_CHILD_INDEX
+#define CHILD_INDEX
+#endif
+// WORD_CODES maps words to codes (see word_codes[]) before they index the
+// double array. Frequent words of text keys get small codes close to each
+// other, so sub nodes of a node span fewer cells, and bases are found sooner
+// and packed tighter. Keys are still ordered by words. Define NO_WORD_CODES
+// to leave it out.
+#ifndef NO_WORD_CODES
+#define WORD_CODES
+#endif
+// TRIE_STATS counts collisions, relocations, base probes and growths for
+// Trie::stats(). Without it, nothing is counted and stats() is all zeros.
+//#define TRIE_STATS
+// Arrays of nodes, tails and tail words of MAP_ARRAY_SIZE bytes or more are
+// mapped by mmap() instead of malloc(), and grown by mremap(), which moves
+// their pages instead of copying them. glibc realloc() does so too, but only
+// above a threshold which rises every time such a block is freed. Define it
+// as 0 to malloc() all of them.
+#ifndef MAP_ARRAY_SIZE
+#define MAP_ARRAY_SIZE (1 << 20)
+#endif
 
 #define EXPECT(c, v) __builtin_expect(c, v)
 // If __builtin_expect() is not supported by your compiler:
 //#define EXPECT(c, v) (c)
+#define PREFETCH(addr) __builtin_prefetch(addr)
+// If __builtin_prefetch() is not supported by your compiler:
+//#define PREFETCH(addr)
+
+// Number of keys search_batch() walks through at the same time.
+#define SEARCH_BATCH_WIDTH 16
+
+// Number of threads which can read ConcurrentTrie at the same time.
+#define MAX_READERS 1024
+#define CACHE_LINE_SIZE 64
 
 #define PRE_ALLOCED_WORDS 64 // used to store words prefix returned to user call
 #if PRE_ALLOCED_WORDS <= 0
@@ -38,165 +88,975 @@
 #if BASE <= ROOT
 #error BASE should be greater then ROOT
 #endif
+#if BLOCK_SIZE <= BASE
+#error BLOCK_SIZE should be greater then BASE
+#endif
+#if MAX_TRIALS <= 0
+#error MAX_TRIALS should be greater then 0
+#endif
+
+#ifdef TRIE_STATS
+#define COUNT(counter, n) (counters.counter += (n))
+#else
+#define COUNT(counter, n)
+#endif
+
+#ifdef WORD_CODES
+// End of key, lowercase letters by frequency in English, digits, and then all
+// other words in ascending order.
+static const unsigned char word_codes[256] = {
+      0,  37,  38,  39,  40,  41,  42,  43,  44,  45,  46,  47,  48,  49,  50,  51,
+     52,  53,  54,  55,  56,  57,  58,  59,  60,  61,  62,  63,  64,  65,  66,  67,
+     68,  69,  70,  71,  72,  73,  74,  75,  76,  77,  78,  79,  80,  81,  82,  83,
+     27,  28,  29,  30,  31,  32,  33,  34,  35,  36,  84,  85,  86,  87,  88,  89,
+     90,  91,  92,  93,  94,  95,  96,  97,  98,  99, 100, 101, 102, 103, 104, 105,
+    106, 107, 108, 109, 110, 111, 112, 113, 114, 115, 116, 117, 118, 119, 120, 121,
+    122,   3,  20,  12,  10,   1,  16,  17,   8,   5,  23,  22,  11,  14,   6,   4,
+     19,  25,   9,   7,   2,  13,  21,  15,  24,  18,  26, 123, 124, 125, 126, 127,
+    128, 129, 130, 131, 132, 133, 134, 135, 136, 137, 138, 139, 140, 141, 142, 143,
+    144, 145, 146, 147, 148, 149, 150, 151, 152, 153, 154, 155, 156, 157, 158, 159,
+    160, 161, 162, 163, 164, 165, 166, 167, 168, 169, 170, 171, 172, 173, 174, 175,
+    176, 177, 178, 179, 180, 181, 182, 183, 184, 185, 186, 187, 188, 189, 190, 191,
+    192, 193, 194, 195, 196, 197, 198, 199, 200, 201, 202, 203, 204, 205, 206, 207,
+    208, 209, 210, 211, 212, 213, 214, 215, 216, 217, 218, 219, 220, 221, 222, 223,
+    224, 225, 226, 227, 228, 229, 230, 231, 232, 233, 234, 235, 236, 237, 238, 239,
+    240, 241, 242, 243, 244, 245, 246, 247, 248, 249, 250, 251, 252, 253, 254, 255,
+};
+
+static const unsigned char code_words[256] = {
+      0, 101, 116,  97, 111, 105, 110, 115, 104, 114, 100, 108,  99, 117, 109, 119,
+    102, 103, 121, 112,  98, 118, 107, 106, 120, 113, 122,  48,  49,  50,  51,  52,
+     53,  54,  55,  56,  57,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,
+     12,  13,  14,  15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25,  26,  27,
+     28,  29,  30,  31,  32,  33,  34,  35,  36,  37,  38,  39,  40,  41,  42,  43,
+     44,  45,  46,  47,  58,  59,  60,  61,  62,  63,  64,  65,  66,  67,  68,  69,
+     70,  71,  72,  73,  74,  75,  76,  77,  78,  79,  80,  81,  82,  83,  84,  85,
+     86,  87,  88,  89,  90,  91,  92,  93,  94,  95,  96, 123, 124, 125, 126, 127,
+    128, 129, 130, 131, 132, 133, 134, 135, 136, 137, 138, 139, 140, 141, 142, 143,
+    144, 145, 146, 147, 148, 149, 150, 151, 152, 153, 154, 155, 156, 157, 158, 159,
+    160, 161, 162, 163, 164, 165, 166, 167, 168, 169, 170, 171, 172, 173, 174, 175,
+    176, 177, 178, 179, 180, 181, 182, 183, 184, 185, 186, 187, 188, 189, 190, 191,
+    192, 193, 194, 195, 196, 197, 198, 199, 200, 201, 202, 203, 204, 205, 206, 207,
+    208, 209, 210, 211, 212, 213, 214, 215, 216, 217, 218, 219, 220, 221, 222, 223,
+    224, 225, 226, 227, 228, 229, 230, 231, 232, 233, 234, 235, 236, 237, 238, 239,
+    240, 241, 242, 243, 244, 245, 246, 247, 248, 249, 250, 251, 252, 253, 254, 255,
+};
+typedef char _word_fits_codes[sizeof (Word) == 1 ? 1 : -1];
+#define CODE(word) (word_codes[(Word)(word)])
+#define WORD_OF(code) (code_words[code])
+#else
+#define CODE(word) (word)
+#define WORD_OF(code) ((Word)(code))
+#endif
 
-#define NEXT_INDEX(base, word) ((base) + (word))
+#define NEXT_INDEX(base, word) ((base) + CODE(word))
 #define NEXT_NODE(base, word) (nodes[NEXT_INDEX(base, word)])
+#define FREE_NEXT(idx) (-nodes[idx].base)
+#define FREE_PREV(idx) (-nodes[idx].prev)
+#define NO_BLOCK (-1)
 
 #define INVARIANT_VIOLATION \
             "Invariant violation: every words should be distinguishable."
+#define UNSORTED_VIOLATION \
+            "Unsorted violation: keys should be sorted in ascending order."
+#define READ_ONLY_VIOLATION \
+            "Read-only violation: trie is a mapped image or a snapshot."
+#define NO_LINKS_VIOLATION \
+            "No links violation: build_links() should be called before scan()."
+#define NO_RANKS_VIOLATION \
+            "No ranks violation: build_ranks() should be called before rank() or key_at()."
+#define NO_REVERSED_VIOLATION \
+            "No reversed violation: build_reversed() should be called before backward segment()."
+#define GROWTH_VIOLATION \
+            "Growth violation: arrays should grow by a factor of at least 1."
+#define INDEX_OVERFLOW \
+            "Index overflow: trie is too big, define TRIE_64BIT_INDEX."
+
+// Most cells of the double array, tails and tail words Index can count.
+// NEXT_INDEX() of the last cell may go 2 blocks further.
+#define MAX_NODES ((numeric_limits<Index>::max() - 2 * BLOCK_SIZE) \
+                   / BLOCK_SIZE * BLOCK_SIZE)
+#define MAX_TAILS (numeric_limits<Index>::max())
+#define MAX_TAIL_WORDS (numeric_limits<Index>::max())
+
+#define TAIL_WORDS(tail) (tail_words + (tail)->words)
+// Words in vector @key, which may be empty.
+#define WORDS_OF(key) ((key).empty() ? NULL : &(key)[0])
+
+// Must be used before writing any part of nodes, tails or tail_words, in case
+// some snapshots are sharing the page with trie.
+#define TOUCH(region, addr, size) \
+            do { \
+                if (EXPECT(cow != NULL, 0)) { \
+                    cow_touch(region, (const char *)(addr), size); \
+                } \
+            } while (0)
+#define TOUCH_NODE(idx) TOUCH(NODES_REGION, nodes + (idx), sizeof *nodes)
+#define TOUCH_TAIL(tail) TOUCH(TAILS_REGION, tail, sizeof *tails)
+#define TOUCH_FAMILY(idx) TOUCH(FAMILY_REGION, family + (idx), sizeof *family)
+#define SET_MAX_DATA(idx, value) \
+            do { \
+                TOUCH(MAX_DATA_REGION, max_data + (idx), sizeof *max_data); \
+                max_data[idx] = (value); \
+            } while (0)
+
+// max_data of subtrees without any key.
+#define NO_DATA (numeric_limits<Data>::min())
+
+// Image layout:
+// header | nodes[n_nodes] | tails[n_tails] | max_data[n_nodes] |
+// family[n_nodes], if saved with CHILD_INDEX | words[n_words].
+// Every part but words starts at a multiple of 8 bytes, so the image can be
+// used by mmap() as it is.
+#define IMAGE_MAGIC "DATRIE\0"
+#define IMAGE_VERSION 7
 
 using namespace std;
 
 
+// Arrays of trie which snapshots can share.
+enum {
+    NODES_REGION,
+    TAILS_REGION,
+    TAIL_WORDS_REGION,
+    MAX_DATA_REGION,
+    FAMILY_REGION,
+    N_REGIONS
+};
+
+struct _CowState;
+struct _CowView;
+
 struct TrieNode {
     Index base;
     Index prev;
 };
 
+// Word + 1 of the first sub node and of the next sibling of a node, 0 for none.
+struct _Family {
+    unsigned short child;
+    unsigned short sibling;
+};
+typedef char _word_fits_family[sizeof (Word) < sizeof (unsigned short) ? 1 : -1];
+
+enum { OPEN_BLOCKS, CLOSED_BLOCKS, FULL_BLOCKS, N_BLOCK_LISTS };
+// A node has at most one sub node for every word.
+#define N_FITTING ((Word)(~0ULL) + 2)
+
+struct _Block {
+    Index prev; // in the block list
+    Index next;
+    Index list;
+    Index n_free;
+    Index head; // a free cell, if any
+    Index reject; // the fewest sub nodes known not to fit in
+    Index n_trials;
+};
+
+// Aho-Corasick automaton of trie. Its states are the nodes, and the words of
+// tails as well: word j (j >= 1) of tail t is state tail_states[t] + j - 1,
+// counted from n_alloced_nodes.
+struct _Link {
+    Index fail;
+    Index output; // the nearest state matching a key on the fail chain
+    Index depth;
+};
+
+struct _Links {
+    Word end_word;
+    Index n_states;
+    struct _Link *links;
+    Index *tail_states; // of every tail
+    Index *state_tails; // of every state of tail words
+};
+
+// Keys which end with end_word, with the words before end_word reversed.
+// segment() walks them from the end of a token to its beginning.
+struct _Reversed {
+    Word end_word;
+    class _Trie *trie;
+    struct _Reversed *next;
+};
+
+// Words of all tails are stored in one pool, tail_words.
 struct _Tail {
-    Word *words;
+    Index words; // offset in tail_words
     Index n_words;
-    Index data;
+    Data data;
     Index used_by;
 };
 
+// State of walking through keys with the same prefix, depth-first without
+// recursion.
+struct _PrefixIterator {
+    const class _Trie *trie;
+    vector<Index> path; // from the node the prefix ends at
+    vector<Word> key;   // words to path.back(), followed by a tail on output
+    Index n_path_words; // words in key to path.back()
+    Index next_word;    // word + 1 of the last sub node visited, 0 for none
+    bool pending;       // key is the only result, waiting for output
+    Data data;         // of the pending key
+};
+
+// State of a Cursor. Keys out of [begin, end) are never reached.
+struct _Cursor {
+    const class _Trie *trie;
+    Index leaf;         // node pointing to the tail of key, 0 at the end
+    vector<Word> key;   // words to leaf, followed by the tail
+    Index n_path_words; // words in key to leaf
+    Data data;
+    vector<Word> begin;
+    vector<Word> end;
+    bool has_end;
+};
+
 class _Trie {
     struct TrieNode *nodes;
     Index n_alloced_nodes;
-#ifdef START_BASE_OPTIMIZATION
-    Index next_unused_node_idx;
-#endif
+    Index n_used_nodes; // cells with a parent, which leaves out root
+    // The greatest data in the subtree of every node, for top_k().
+    Data *max_data;
+    // Sibling lists of every node, NULL without CHILD_INDEX or in an image
+    // saved without it.
+    struct _Family *family;
+    // Free cells, NULL in an image or a snapshot, which are read only.
+    struct _Block *blocks;
+    Index block_lists[N_BLOCK_LISTS];
     struct _Tail *tails;
     Index n_alloced_tails;
+    Index n_used_tails;
     Index next_unused_tail_idx;
+    Word *tail_words;
+    Index n_alloced_tail_words;
+    Index n_used_tail_words;
+    // Words in tail_words not used by any tail any more.
+    Index n_garbage_tail_words;
+    // Words tails would take more than they do, because compact() lets
+    // tails which end with the same words share them.
+    Index n_shared_tail_words;
+    void *image; // not NULL when trie is opened by open_mapped()
+    size_t image_size;
+    struct _CowState *cow; // not NULL when trie or its snapshot is shared
+    struct _CowView *view; // not NULL when trie is a snapshot
+    struct _Links *links; // not NULL after build_links()
+    // Built by build_reversed(), and kept by insert() and erase().
+    struct _Reversed *reversed;
+#ifdef TRIE_STATS
+    TrieStats counters;
+#endif
+    // Number of the first key below every node, not NULL after build_ranks().
+    Index *ranks;
+    Index n_ranked_keys;
+    // Arrays grow to growth_factor times their size, and by growth_chunk
+    // entries at least.
+    double growth_factor;
+    Index growth_chunk;
+    // Where compact_storage() goes on, 0 before it starts a pass.
+    Index compacting_node;
+    Index compacting_tail;
+    // No block before fitting_blocks[n] fits n sub nodes, in this pass.
+    Index fitting_blocks[N_FITTING];
+
+    void *get_region(int region, size_t *size) const;
+    void set_region(int region, void *addr);
+    void *resize_region(int region, void *addr, size_t size);
+    void enter_cow(void);
+    void leave_cow(void);
+    void cow_touch(int region, const char *addr, size_t size);
+    void cow_break(int region, size_t page);
 
+    void init(void);
+    void release(void);
+    void drop_links(void);
+    void drop_ranks(void);
+    const _Trie *reversed_trie(Word end_word) const;
+    void insert_reversed(const Word words[], Index n_words, Data data);
+    void erase_reversed(const Word words[], Index n_words);
+    void drop_reversed(void);
+    Index key_of_node(Index tn_idx, Word words[], Index max_words) const;
+    Index next_state(Index state, Word word) const;
+    bool match_state(Index state, Data *data) const;
+    Index grown_size(Index size, Index needed, Index max_size) const;
     void expand_nodes(Index next);
-#ifdef START_BASE_OPTIMIZATION
-    void inc_next_unused_node_idx(Index idx);
-    void dec_next_unused_node_idx(Index idx);
-#endif
+    void grow_nodes(Index n_nodes);
+    void grow_tails(Index n_tails);
+    void grow_tail_words(Index n_words);
+    void init_blocks(Index from, Index to);
+    void push_block(Index b, Index list);
+    void pop_block(Index b);
+    Index find_base(const Word words[], Index n_words);
+    void use_node(Index idx);
+    void free_node(Index idx);
+    Index find_lower_base(const vector<Word>& subs, Index limit,
+                          Index *n_steps);
+    void prune_node(Index tn_idx);
+    void shrink_nodes(void);
+    void shrink_tails(void);
 
     Index get_next_unused_tail_idx(void);
     void set_next_unused_tail_idx(Index idx);
+    Index alloc_tail_words(Index n_words);
+    Index n_live_tail_words(void) const;
+    bool compact_tail_words(Index n_alloced_words);
+    void replace_tail_words(Word *words, Index n_used_words,
+                            Index n_alloced_words);
+    void insert_key(const Word words[], Index n_words, Data data);
+    void free_tail(Index tail_idx);
     void fill_tail(Index tail_idx, const Word words[], Index n_words,
-                   Index data, Index tn_idx);
+                   Data data, Index tn_idx);
 
     void adjust(Index tn_idx, const vector<Word>& subs);
     void adjust(Index tn_idx, const vector<Word>& subs, const Word& word);
     void move(Index tn_idx, const vector<Word>& subs, Index offset);
     void collect_sub_nodes(Index tn_idx, vector<Word>& subs) const;
+    Index first_sub_node(Index tn_idx) const;
+    Index next_sub_node(Index tn_idx, Index sub) const;
+    Index scan_sub_node(Index tn_idx, Index from) const;
+    Index last_sub_node(Index tn_idx) const;
+    Index prev_sub_node(Index tn_idx, Index sub) const;
+    void link_sub_node(Index tn_idx, Index sub);
+    void unlink_sub_node(Index tn_idx, Index sub);
     void erase_all_subs(Index tn_idx);
-    void collect_all_subs(Index tn_idx, vector<Index>& results) const;
+    Data sub_max_data(Index tn_idx) const;
+    void raise_max_data(Index tn_idx, Data data);
+    void update_max_data(Index tn_idx);
+    void init_max_data(void);
+    void collect_all_subs(Index tn_idx, vector<Data>& results) const;
     void collect_all_subs(Index tn_idx, struct Tail *result,
                           Index n_alloced_words, vector<Tail>& results) const;
 
     bool search(const Word words[], Index n_words,
-                struct _Tail **tailp, Index *data, Index *unmatch) const;
+                struct _Tail **tailp, Data *data, Index *unmatch) const;
     bool search(const Word words[], Index n_words, struct _Tail **tailp) const;
 
+    void cursor_down(struct _Cursor *cursor, Index tn_idx, bool back) const;
+    void cursor_over(struct _Cursor *cursor, Index tn_idx, bool back) const;
+    void seek_cursor(struct _Cursor *cursor, const Word words[],
+                     Index n_words, bool upper) const;
+    bool limit_cursor(struct _Cursor *cursor) const;
+
 public:
     _Trie(void);
     ~_Trie(void);
+    _Trie *clone(void) const;
+    _Trie *snapshot(void);
 
-    void insert(const Word words[], Index n_words, Index data);
+    void insert(const Word words[], Index n_words, Data data);
     void erase(const Word words[], Index n_words);
     bool search(const Word words[], Index n_words,
-                Index *data, Index *unmatch) const;
+                Data *data, Index *unmatch) const;
+    void search_batch(const Word *const words[], const Index n_words[],
+                      Index n, Data data[], bool found[]) const;
     void prefix(const Word words[], Index n_words, vector<Tail>& results) const;
-    void prefix(const Word words[], Index n_words, vector<Index>& results) const;
+    void prefix(const Word words[], Index n_words, vector<Data>& results) const;
+    void for_each_prefix(const Word words[], Index n_words,
+                         PrefixCallback callback, void *arg) const;
+    void top_k(const Word words[], Index n_words, Index k,
+               PrefixCallback callback, void *arg) const;
+    void fuzzy_search(const Word words[], Index n_words, Index max_edits,
+                      FuzzyCallback callback, void *arg) const;
+    bool next_edit_row(const Word words[], Index n_words, Index max_edits,
+                       Word word, vector<Index>& rows, Index depth) const;
+    void first_prefix(struct _PrefixIterator *iter,
+                      const Word words[], Index n_words) const;
+    bool next_prefix(struct _PrefixIterator *iter, const Word **words,
+                     Index *n_words, Data *data) const;
+    bool bound_cursor(struct _Cursor *cursor, const Word words[],
+                      Index n_words, bool upper) const;
+    bool last_cursor(struct _Cursor *cursor) const;
+    bool next_cursor(struct _Cursor *cursor) const;
+    bool prev_cursor(struct _Cursor *cursor) const;
     bool segment_max_match(const Word words[], Index n_words, Word end_word,
-                           Index *data, Index *unmatch) const;
+                           Data *data, Index *unmatch) const;
     bool segment_min_match(const Word words[], Index n_words, Word end_word,
-                           Index *data, Index *unmatch) const;
+                           Data *data, Index *unmatch) const;
+    Index common_prefix_search(const Word words[], Index n_words, Word end_word,
+                               Match results[], Index max_results) const;
+    bool forward_token(const Word text[], Index n_words, Index begin,
+                       Word end_word, Token *token) const;
+    bool backward_token(const Word text[], Index n_words, Index end,
+                        Word end_word, Token *token) const;
+    Index forward_match(const Word text[], Index n_words, Word end_word,
+                        Token tokens[], Index max_tokens) const;
+    Index backward_match(const _Trie *backward, const Word text[],
+                         Index n_words, Word end_word, Token tokens[],
+                         Index max_tokens) const;
+    Index segment(const Word text[], Index n_words, Word end_word,
+                  SegmentMode mode, Token tokens[], Index max_tokens) const;
+    void build_links(Word end_word);
+    void build_reversed(Word end_word);
+    Index handle(const Word words[], Index n_words) const;
+    Index key_of(Index handle, Word words[], Index max_words,
+                 Data *data) const;
+    void build_ranks(void);
+    Index rank(const Word words[], Index n_words) const;
+    Index key_at(Index ordinal, Word words[], Index max_words,
+                 Data *data) const;
+    bool scan(const Word text[], Index n_words, ScanCallback callback,
+              void *arg, ScanState *state) const;
+    void build(const Word *const keys[], const Index n_words[],
+               const Data data[], Index n_keys);
+    void compact(void);
+    bool compact_storage(Index max_steps);
+    void reserve(Index n_keys, Index n_words);
+    void set_growth(double factor, Index chunk);
+    TrieStats stats(void) const;
+    double density(void) const;
+    MemoryUsage memory_usage(void) const;
+    bool save(const char *path) const;
+    bool open_mapped(const char *path);
+};
+
+struct _ImageHeader {
+    char magic[8];
+    unsigned version;
+    unsigned index_size;
+    unsigned node_size;
+    unsigned tail_size;
+    unsigned family_size; // 0 if family is not saved
+    Index n_nodes;
+    Index n_tails;
+    uint64_t n_words;
+    uint64_t codes;    // checksum of word_codes[], 0 without WORD_CODES
+    uint64_t checksum; // of everything after the header
 };
 
+static uint64_t checksum(uint64_t sum, const void *buf, size_t size)
+{
+    // FNV-1a
+    const unsigned char *p = (const unsigned char *)buf;
+    for (; size; p++, size--) {
+        sum = (sum ^ *p) * 0x100000001b3ULL;
+    }
+    return sum;
+}
+
+// Images are only valid with the same word codes.
+static uint64_t codes_checksum(void)
+{
+#ifdef WORD_CODES
+    return checksum(0xcbf29ce484222325ULL, word_codes, sizeof word_codes);
+#else
+    return 0;
+#endif
+}
+
+// Arrays of nodes, tails and tail words, zeroed when allocated. Each one
+// starts with its size, which tells how it is given back.
+#define ARRAY_HEADER_SIZE 16
+
+static bool is_mapped_array(size_t size)
+{
+    return MAP_ARRAY_SIZE > 0 && size >= (size_t)MAP_ARRAY_SIZE;
+}
+
+static void *alloc_array(size_t size)
+{
+    size += ARRAY_HEADER_SIZE;
+    char *addr;
+    if (!is_mapped_array(size)) {
+        addr = (char *)calloc(1, size);
+    } else {
+        addr = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            addr = NULL;
+        }
+    }
+    if (!addr) {
+        return NULL;
+    }
+    *(size_t *)addr = size;
+    return addr + ARRAY_HEADER_SIZE;
+}
+
+static void free_array(void *addr)
+{
+    if (!addr) {
+        return;
+    }
+    char *start = (char *)addr - ARRAY_HEADER_SIZE;
+    size_t size = *(size_t *)start;
+    if (!is_mapped_array(size)) {
+        free(start);
+    } else {
+        munmap(start, size);
+    }
+}
+
+// realloc(), which keeps @addr if it fails.
+static void *realloc_array(void *addr, size_t size)
+{
+    if (!addr) {
+        return alloc_array(size);
+    }
+    char *start = (char *)addr - ARRAY_HEADER_SIZE;
+    size_t old_size = *(size_t *)start;
+    size += ARRAY_HEADER_SIZE;
+    if (is_mapped_array(old_size) != is_mapped_array(size)) {
+        char *new_addr = (char *)alloc_array(size - ARRAY_HEADER_SIZE);
+        if (new_addr) {
+            memcpy(new_addr, addr, (old_size < size ? old_size : size) -
+                                   ARRAY_HEADER_SIZE);
+            free_array(addr);
+        }
+        return new_addr;
+    }
+    if (!is_mapped_array(size)) {
+        start = (char *)realloc(start, size);
+    } else {
+        start = (char *)mremap(start, old_size, size, MREMAP_MAYMOVE);
+        if (start == MAP_FAILED) {
+            start = NULL;
+        }
+    }
+    if (!start) {
+        return NULL;
+    }
+    *(size_t *)start = size;
+    return start + ARRAY_HEADER_SIZE;
+}
+
 _Trie::_Trie(void)
 {
-    n_alloced_nodes = ROOT + 1;
-    nodes = (struct TrieNode *)calloc(n_alloced_nodes, sizeof *nodes);
+    init();
+    growth_factor = 2;
+    growth_chunk = 0;
+}
+
+void _Trie::init(void)
+{
+    n_alloced_nodes = BLOCK_SIZE;
+    nodes = (struct TrieNode *)alloc_array(n_alloced_nodes * sizeof *nodes);
     if (!nodes) {
         throw bad_alloc();
     }
     nodes[ROOT].base = BASE;
-#ifdef START_BASE_OPTIMIZATION
-    // +1 is not needed but I want to leave the first Word space for the first
-    // Word. (nodes[ROOT].base == BASE forever)
-    next_unused_node_idx = BASE + (Word)(~0ULL) + 1;
+    n_used_nodes = 0;
+    max_data = (Data *)alloc_array(n_alloced_nodes * sizeof *max_data);
+    if (!max_data) {
+        free_array(nodes);
+        throw bad_alloc();
+    }
+    max_data[ROOT] = NO_DATA;
+#ifdef CHILD_INDEX
+    family = (struct _Family *)alloc_array(n_alloced_nodes * sizeof *family);
+    if (!family) {
+        free_array(nodes);
+        free_array(max_data);
+        throw bad_alloc();
+    }
+#else
+    family = NULL;
 #endif
+    blocks = (struct _Block *)malloc(sizeof *blocks);
+    if (!blocks) {
+        free_array(nodes);
+        free_array(max_data);
+        free_array(family);
+        throw bad_alloc();
+    }
+    for (int i = 0; i < N_BLOCK_LISTS; i++) {
+        block_lists[i] = NO_BLOCK;
+    }
+    init_blocks(0, 1);
 
     n_alloced_tails = 1;
-    tails = (struct _Tail *)calloc(n_alloced_tails, sizeof (*tails));
+    tails = (struct _Tail *)alloc_array(n_alloced_tails * sizeof *tails);
     if (!tails) {
-        free(nodes);
+        free_array(nodes);
+        free_array(max_data);
+        free_array(family);
+        free(blocks);
         throw bad_alloc();
     }
+    n_used_tails = 0;
     next_unused_tail_idx = 0;
+
+    tail_words = NULL;
+    n_alloced_tail_words = 0;
+    n_used_tail_words = 0;
+    n_garbage_tail_words = 0;
+    n_shared_tail_words = 0;
+
+    image = NULL;
+    image_size = 0;
+    cow = NULL;
+    view = NULL;
+    links = NULL;
+    reversed = NULL;
+    ranks = NULL;
+    n_ranked_keys = 0;
+    compacting_node = 0;
+    compacting_tail = 0;
+#ifdef TRIE_STATS
+    memset(&counters, 0, sizeof counters);
+    counters.enabled = true;
+#endif
 }
 
 _Trie::~_Trie(void)
 {
-    free(nodes);
-    for (Index i = 0; i < n_alloced_tails; i++) {
-        free(tails[i].words);
+    release();
+}
+
+void _Trie::release(void)
+{
+    drop_links();
+    drop_ranks();
+    drop_reversed();
+    free(blocks);
+    if (image) {
+        munmap(image, image_size);
+        return;
+    }
+    if (cow) {
+        leave_cow();
+        return;
+    }
+    free_array(nodes);
+    free_array(max_data);
+    free_array(family);
+    free_array(tails);
+    free_array(tail_words);
+}
+
+_Trie *_Trie::clone(void) const
+{
+    assert(blocks);
+    _Trie *copy = new _Trie;
+    struct TrieNode *copy_nodes = (struct TrieNode *)alloc_array(
+                                            n_alloced_nodes * sizeof *nodes);
+    Data *copy_max_data = (Data *)alloc_array(n_alloced_nodes * sizeof *max_data);
+    struct _Family *copy_family = NULL;
+    if (family) {
+        copy_family = (struct _Family *)alloc_array(n_alloced_nodes *
+                                                    sizeof *family);
+    }
+    struct _Block *copy_blocks = (struct _Block *)malloc(
+                            n_alloced_nodes / BLOCK_SIZE * sizeof *blocks);
+    struct _Tail *copy_tails = (struct _Tail *)alloc_array(
+                                            n_alloced_tails * sizeof *tails);
+    Word *copy_tail_words = NULL;
+    if (n_alloced_tail_words) {
+        copy_tail_words = (Word *)alloc_array(n_alloced_tail_words *
+                                              sizeof *tail_words);
+    }
+    if (!copy_nodes || !copy_max_data || (family && !copy_family) ||
+        !copy_blocks || !copy_tails ||
+        (n_alloced_tail_words && !copy_tail_words)) {
+        free_array(copy_nodes);
+        free_array(copy_max_data);
+        free_array(copy_family);
+        free(copy_blocks);
+        free_array(copy_tails);
+        free_array(copy_tail_words);
+        delete copy;
+        throw bad_alloc();
+    }
+    memcpy(copy_nodes, nodes, n_alloced_nodes * sizeof *nodes);
+    memcpy(copy_max_data, max_data, n_alloced_nodes * sizeof *max_data);
+    if (family) {
+        memcpy(copy_family, family, n_alloced_nodes * sizeof *family);
+    }
+    memcpy(copy_blocks, blocks, n_alloced_nodes / BLOCK_SIZE * sizeof *blocks);
+    memcpy(copy_tails, tails, n_alloced_tails * sizeof *tails);
+    if (n_used_tail_words) {
+        memcpy(copy_tail_words, tail_words,
+               n_used_tail_words * sizeof *tail_words);
+    }
+
+    copy->release();
+    copy->nodes = copy_nodes;
+    copy->n_alloced_nodes = n_alloced_nodes;
+    copy->n_used_nodes = n_used_nodes;
+    copy->max_data = copy_max_data;
+    copy->family = copy_family;
+    copy->blocks = copy_blocks;
+    memcpy(copy->block_lists, block_lists, sizeof block_lists);
+    copy->tails = copy_tails;
+    copy->n_alloced_tails = n_alloced_tails;
+    copy->n_used_tails = n_used_tails;
+    copy->next_unused_tail_idx = next_unused_tail_idx;
+    copy->tail_words = copy_tail_words;
+    copy->n_alloced_tail_words = n_alloced_tail_words;
+    copy->n_used_tail_words = n_used_tail_words;
+    copy->n_garbage_tail_words = n_garbage_tail_words;
+    copy->n_shared_tail_words = n_shared_tail_words;
+    copy->growth_factor = growth_factor;
+    copy->growth_chunk = growth_chunk;
+#ifdef TRIE_STATS
+    copy->counters = counters;
+#endif
+    return copy;
+}
+
+// Size an array of @size entries grows to, which holds @needed at least.
+Index _Trie::grown_size(Index size, Index needed, Index max_size) const
+{
+    Index grown = size * growth_factor > max_size ? max_size
+                  : (Index)(size * growth_factor);
+    if (growth_chunk > max_size - size) {
+        grown = max_size;
+    } else if (grown < size + growth_chunk) {
+        grown = size + growth_chunk;
     }
-    free(tails);
+    return grown < needed ? needed : grown;
 }
 
 void _Trie::expand_nodes(Index next)
 {
     assert(next >= n_alloced_nodes);
 
+    if (next >= MAX_NODES) {
+        throw length_error(INDEX_OVERFLOW);
+    }
+    grow_nodes(grown_size(n_alloced_nodes, next + 1, MAX_NODES));
+}
+
+// Grow the double array to @n_nodes cells at least.
+void _Trie::grow_nodes(Index n_nodes)
+{
+    assert(n_nodes > n_alloced_nodes && n_nodes <= MAX_NODES);
+
+    COUNT(node_growths, 1);
     Index old_n_alloced_nodes = n_alloced_nodes;
     struct TrieNode *old_nodes = nodes;
-    n_alloced_nodes = next >= (n_alloced_nodes << 1) ? next + 1
-                                                     : (n_alloced_nodes << 1);
-    nodes = (struct TrieNode *)realloc(nodes, n_alloced_nodes * sizeof *nodes);
+    n_alloced_nodes = (n_nodes + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    struct _Block *new_blocks = (struct _Block *)realloc(blocks,
+                            n_alloced_nodes / BLOCK_SIZE * sizeof *blocks);
+    if (!new_blocks) {
+        n_alloced_nodes = old_n_alloced_nodes;
+        throw bad_alloc();
+    }
+    blocks = new_blocks;
+    nodes = (struct TrieNode *)resize_region(NODES_REGION, nodes,
+                                             n_alloced_nodes * sizeof *nodes);
     if (!nodes) {
         n_alloced_nodes = old_n_alloced_nodes;
         nodes = old_nodes;
         throw bad_alloc();
     }
+    Data *new_max_data = (Data *)resize_region(MAX_DATA_REGION, max_data,
+                                        n_alloced_nodes * sizeof *max_data);
+    if (!new_max_data) {
+        // nodes is bigger than needed, which is fine.
+        n_alloced_nodes = old_n_alloced_nodes;
+        throw bad_alloc();
+    }
+    max_data = new_max_data;
+    if (family) {
+        struct _Family *new_family = (struct _Family *)resize_region(
+                FAMILY_REGION, family, n_alloced_nodes * sizeof *family);
+        if (!new_family) {
+            n_alloced_nodes = old_n_alloced_nodes;
+            throw bad_alloc();
+        }
+        family = new_family;
+        TOUCH(FAMILY_REGION, family + old_n_alloced_nodes,
+              (n_alloced_nodes - old_n_alloced_nodes) * sizeof *family);
+        memset(family + old_n_alloced_nodes, 0,
+               (n_alloced_nodes - old_n_alloced_nodes) * sizeof *family);
+    }
+
+    TOUCH(NODES_REGION, nodes + old_n_alloced_nodes,
+          (n_alloced_nodes - old_n_alloced_nodes) * sizeof *nodes);
     memset(nodes + old_n_alloced_nodes, 0,
            (n_alloced_nodes - old_n_alloced_nodes) * sizeof *nodes);
+    init_blocks(old_n_alloced_nodes / BLOCK_SIZE, n_alloced_nodes / BLOCK_SIZE);
 }
 
-#ifdef START_BASE_OPTIMIZATION
-void _Trie::inc_next_unused_node_idx(Index idx)
+// Free cells are managed block by block, as in cedar. Free cells (prev <= 0)
+// of a block are linked in a circular doubly linked list: base of a free cell
+// is -(next free cell), and prev is -(previous free cell). Blocks are kept in
+// three lists: open blocks, which are tried for nodes of several sub nodes;
+// closed blocks, which have only 1 free cell or have been tried too many
+// times, and are used for single sub nodes; and full blocks.
+void _Trie::init_blocks(Index from, Index to)
 {
-    if (idx == next_unused_node_idx) {
-        while (++next_unused_node_idx < n_alloced_nodes) {
-            if (!nodes[next_unused_node_idx].prev) {
-                break;
+    for (Index b = from; b < to; b++) {
+        struct _Block *block = blocks + b;
+        Index first = b * BLOCK_SIZE < BASE ? BASE : b * BLOCK_SIZE;
+        Index last = (b + 1) * BLOCK_SIZE - 1;
+        for (Index i = first; i <= last; i++) {
+            nodes[i].base = -(i + 1);
+            nodes[i].prev = -(i - 1);
+        }
+        nodes[first].prev = -last;
+        nodes[last].base = -first;
+        block->n_free = last - first + 1;
+        block->head = first;
+        block->reject = block->n_free + 1;
+        block->n_trials = 0;
+        push_block(b, OPEN_BLOCKS);
+    }
+}
+
+void _Trie::push_block(Index b, Index list)
+{
+    struct _Block *block = blocks + b;
+    Index head = block_lists[list];
+    if (head == NO_BLOCK) {
+        block->prev = block->next = b;
+        block_lists[list] = b;
+    } else {
+        block->next = head;
+        block->prev = blocks[head].prev;
+        blocks[block->prev].next = b;
+        blocks[head].prev = b;
+    }
+    block->list = list;
+}
+
+void _Trie::pop_block(Index b)
+{
+    struct _Block *block = blocks + b;
+    if (block->next == b) {
+        block_lists[block->list] = NO_BLOCK;
+    } else {
+        blocks[block->prev].next = block->next;
+        blocks[block->next].prev = block->prev;
+        if (block_lists[block->list] == b) {
+            block_lists[block->list] = block->next;
+        }
+    }
+}
+
+// Return a base which puts all @words at free cells, or at cells after the
+// array if no block has room for them.
+Index _Trie::find_base(const Word words[], Index n_words)
+{
+    assert(n_words > 0);
+    COUNT(find_bases, 1);
+
+    if (n_words == 1 && block_lists[CLOSED_BLOCKS] != NO_BLOCK) {
+        Index base = blocks[block_lists[CLOSED_BLOCKS]].head - CODE(words[0]);
+        if (base >= BASE) {
+            return base;
+        }
+    }
+
+    // Blocks closed on the way are taken out of the list, but the list is
+    // never added to, so it ends at the block which is the last now.
+    Index b = block_lists[OPEN_BLOCKS];
+    Index last_b = b == NO_BLOCK ? NO_BLOCK : blocks[b].prev;
+    while (b != NO_BLOCK) {
+        struct _Block *block = blocks + b;
+        Index next_b = b == last_b ? NO_BLOCK : block->next;
+        if (block->n_free >= n_words && n_words < block->reject) {
+            Index f = block->head;
+            do {
+                COUNT(base_probes, 1);
+                Index base = f - CODE(words[0]);
+                if (base >= BASE) {
+                    Index i;
+                    for (i = 1; i < n_words; i++) {
+                        Index next = NEXT_INDEX(base, words[i]);
+                        if (next < n_alloced_nodes && nodes[next].prev > 0) {
+                            break;
+                        }
+                    }
+                    if (i == n_words) {
+                        return base;
+                    }
+                }
+                f = FREE_NEXT(f);
+            } while (f != block->head);
+
+            block->reject = n_words;
+            if (++block->n_trials >= MAX_TRIALS) {
+                pop_block(b);
+                push_block(b, CLOSED_BLOCKS);
             }
         }
+        b = next_b;
+    }
+
+    Index min_code = CODE(words[0]);
+    for (Index i = 1; i < n_words; i++) {
+        if (CODE(words[i]) < min_code) {
+            min_code = CODE(words[i]);
+        }
+    }
+    COUNT(base_fallbacks, 1);
+    Index base = n_alloced_nodes - min_code;
+    return base < BASE ? BASE : base;
+}
+
+// Take free cell @idx out of its block.
+void _Trie::use_node(Index idx)
+{
+    assert(idx >= BASE && idx < n_alloced_nodes && nodes[idx].prev <= 0);
+
+    Index b = idx / BLOCK_SIZE;
+    struct _Block *block = blocks + b;
+    Index next = FREE_NEXT(idx);
+    Index prev = FREE_PREV(idx);
+    TOUCH_NODE(prev);
+    nodes[prev].base = -next;
+    TOUCH_NODE(next);
+    nodes[next].prev = -prev;
+    TOUCH_NODE(idx);
+    nodes[idx].base = 0;
+    nodes[idx].prev = 0;
+    if (block->head == idx) {
+        block->head = next;
+    }
+    n_used_nodes++;
+    if (!--block->n_free) {
+        pop_block(b);
+        push_block(b, FULL_BLOCKS);
+    } else if (block->n_free == 1 && block->list == OPEN_BLOCKS) {
+        pop_block(b);
+        push_block(b, CLOSED_BLOCKS);
     }
 }
 
-void _Trie::dec_next_unused_node_idx(Index idx)
+// Give cell @idx, which is not used any more, back to its block.
+void _Trie::free_node(Index idx)
 {
-    if (idx > BASE + (Word)(~0ULL) && idx < next_unused_node_idx) {
-        next_unused_node_idx = idx;
+    assert(idx >= BASE && idx < n_alloced_nodes && nodes[idx].prev > 0);
+
+    Index b = idx / BLOCK_SIZE;
+    struct _Block *block = blocks + b;
+    TOUCH_NODE(idx);
+    if (!block->n_free) {
+        nodes[idx].base = -idx;
+        nodes[idx].prev = -idx;
+        block->head = idx;
+    } else {
+        Index next = block->head;
+        Index prev = FREE_PREV(next);
+        nodes[idx].base = -next;
+        nodes[idx].prev = -prev;
+        TOUCH_NODE(prev);
+        nodes[prev].base = -idx;
+        TOUCH_NODE(next);
+        nodes[next].prev = -idx;
+    }
+    n_used_nodes--;
+    block->n_free++;
+    block->reject = block->n_free + 1;
+    if (block->list != OPEN_BLOCKS && block->n_free > 1) {
+        pop_block(b);
+        block->n_trials = 0;
+        push_block(b, OPEN_BLOCKS);
+    } else if (block->list == FULL_BLOCKS) {
+        pop_block(b);
+        push_block(b, CLOSED_BLOCKS);
     }
 }
-#endif
 
 Index _Trie::get_next_unused_tail_idx(void)
 {
     assert(next_unused_tail_idx <= n_alloced_tails);
 
     if (next_unused_tail_idx == n_alloced_tails) {
-        Index old_n_alloced_tails = n_alloced_tails;
-        struct _Tail *old_tails = tails;
         assert(n_alloced_tails);
-        n_alloced_tails = n_alloced_tails << 1;
-        tails = (struct _Tail *)realloc(tails, n_alloced_tails * sizeof *tails);
-        if (!tails) {
-            n_alloced_tails = old_n_alloced_tails;
-            tails = old_tails;
-            throw bad_alloc();
+        if (n_alloced_tails == MAX_TAILS) {
+            throw length_error(INDEX_OVERFLOW);
         }
-        memset(tails + old_n_alloced_tails, 0,
-                (n_alloced_tails - old_n_alloced_tails) * sizeof *tails);
+        grow_tails(grown_size(n_alloced_tails, n_alloced_tails + 1, MAX_TAILS));
         return next_unused_tail_idx++;
     }
     Index result = next_unused_tail_idx;
@@ -208,6 +1068,24 @@ Index _Trie::get_next_unused_tail_idx(void)
     return result;
 }
 
+void _Trie::grow_tails(Index n_tails)
+{
+    assert(n_tails > n_alloced_tails && n_tails <= MAX_TAILS);
+
+    COUNT(tail_growths, 1);
+    struct _Tail *new_tails = (struct _Tail *)resize_region(TAILS_REGION, tails,
+                                                  n_tails * sizeof *tails);
+    if (!new_tails) {
+        throw bad_alloc();
+    }
+    tails = new_tails;
+    TOUCH(TAILS_REGION, tails + n_alloced_tails,
+          (n_tails - n_alloced_tails) * sizeof *tails);
+    memset(tails + n_alloced_tails, 0,
+           (n_tails - n_alloced_tails) * sizeof *tails);
+    n_alloced_tails = n_tails;
+}
+
 void _Trie::set_next_unused_tail_idx(Index idx)
 {
     if (idx < next_unused_tail_idx) {
@@ -215,62 +1093,553 @@ void _Trie::set_next_unused_tail_idx(Index idx)
     }
 }
 
-void _Trie::fill_tail(Index tail_idx, const Word words[], Index n_words,
-                      Index data, Index tn_idx)
+Index _Trie::alloc_tail_words(Index n_words)
 {
-    struct _Tail *tail = tails + tail_idx;
+    if (EXPECT(n_words > n_alloced_tail_words - n_used_tail_words, 0)) {
+        Index n_live_words = n_live_tail_words();
+        if (n_garbage_tail_words > n_live_words &&
+            n_words <= MAX_TAIL_WORDS - n_live_words) {
+            Index n_needed_words = n_live_words + n_words;
+            compact_tail_words(grown_size(n_needed_words, n_needed_words,
+                                          MAX_TAIL_WORDS));
+        }
+    }
+    if (EXPECT(n_words > n_alloced_tail_words - n_used_tail_words, 0)) {
+        if (n_words > MAX_TAIL_WORDS - n_used_tail_words) {
+            throw length_error(INDEX_OVERFLOW);
+        }
+        Index n_needed_words = n_used_tail_words + n_words;
+        if (!n_alloced_tail_words) {
+            grow_tail_words(n_needed_words > PRE_ALLOCED_WORDS
+                            ? n_needed_words : PRE_ALLOCED_WORDS);
+        } else {
+            grow_tail_words(grown_size(n_alloced_tail_words, n_needed_words,
+                                       MAX_TAIL_WORDS));
+        }
+    }
+    Index result = n_used_tail_words;
+    n_used_tail_words += n_words;
+    return result;
+}
 
-    assert(!tail->words);
-    tail->n_words = n_words;
-    if (n_words) {
-        tail->words = (Word *)malloc(n_words * sizeof *tail->words);
-        if (!tail->words) {
-            throw bad_alloc();
+void _Trie::grow_tail_words(Index n_words)
+{
+    assert(n_words > n_alloced_tail_words && n_words <= MAX_TAIL_WORDS);
+
+    COUNT(tail_word_growths, 1);
+    Word *words = (Word *)resize_region(TAIL_WORDS_REGION, tail_words,
+                                        n_words * sizeof *tail_words);
+    if (!words) {
+        throw bad_alloc();
+    }
+    tail_words = words;
+    n_alloced_tail_words = n_words;
+}
+
+// Words of all tails, as if no words were shared.
+Index _Trie::n_live_tail_words(void) const
+{
+    return n_used_tail_words + n_shared_tail_words - n_garbage_tail_words;
+}
+
+// Copy words of all tails to a new pool of @n_alloced_words words, leaving
+// out the garbage. Words shared by compact() are copied for every tail.
+bool _Trie::compact_tail_words(Index n_alloced_words)
+{
+    assert(n_alloced_words >= n_live_tail_words());
+
+    Word *words = NULL;
+    if (n_alloced_words) {
+        words = (Word *)alloc_array(n_alloced_words * sizeof *tail_words);
+        if (!words) {
+            return false;
         }
-        memcpy(tail->words, words, n_words * sizeof *tail->words);
-    } else {
-        tail->words = NULL;
     }
-    tail->data = data;
-    tail->used_by = tn_idx;
+    Index n_used_words = 0;
+    for (Index i = 0; i < n_alloced_tails; i++) {
+        struct _Tail *tail = tails + i;
+        if (tail->used_by && tail->n_words) {
+            memcpy(words + n_used_words, TAIL_WORDS(tail),
+                   tail->n_words * sizeof *tail_words);
+            TOUCH_TAIL(tail);
+            tail->words = n_used_words;
+            n_used_words += tail->n_words;
+        }
+    }
+    replace_tail_words(words, n_used_words, n_alloced_words);
+    n_shared_tail_words = 0;
+    return true;
 }
 
-void _Trie::insert(const Word words[], Index n_words, Index data)
+// Replace tail_words by @words, which is allocated by alloc_array() and holds
+// the words of all tails in its first @n_used_words words.
+void _Trie::replace_tail_words(Word *words, Index n_used_words,
+                               Index n_alloced_words)
 {
-    struct _Tail *tail;
-    if (search(words, n_words, &tail)) {
-        tail->data = data;
-        return;
+    if (cow) {
+        // tail_words is shared, and is never replaced by another block.
+        if (n_alloced_words > n_alloced_tail_words) {
+            Word *grown = (Word *)resize_region(TAIL_WORDS_REGION, tail_words,
+                                            n_alloced_words * sizeof *tail_words);
+            if (!grown) {
+                free_array(words);
+                throw bad_alloc();
+            }
+            tail_words = grown;
+            n_alloced_tail_words = n_alloced_words;
+        }
+        // words is NULL if no word is used.
+        if (words) {
+            TOUCH(TAIL_WORDS_REGION, tail_words,
+                  n_used_words * sizeof *tail_words);
+            memcpy(tail_words, words, n_used_words * sizeof *tail_words);
+            free_array(words);
+        }
+    } else {
+        free_array(tail_words);
+        tail_words = words;
+        n_alloced_tail_words = n_alloced_words;
     }
+    n_used_tail_words = n_used_words;
+    n_garbage_tail_words = 0;
+}
 
-    Index tn_idx = ROOT;
-    for (Index i = 0; i < n_words; i++) {
-        Index base = nodes[tn_idx].base;
-        Index next;
+// Orders tails by their words read backwards, so a tail comes right before
+// the tails it is a suffix of.
+struct _TailSuffixLess {
+    const struct _Tail *tails;
+    const Word *tail_words;
 
-        if (base >= BASE) {
-            next = NEXT_INDEX(base, words[i]);
-            if (EXPECT(next >= n_alloced_nodes, 0)) {
-                expand_nodes(next);
-            } else {
-                Index next_prev = nodes[next].prev;
+    bool operator()(Index a, Index b) const
+    {
+        const Word *end_a = TAIL_WORDS(tails + a) + tails[a].n_words;
+        const Word *end_b = TAIL_WORDS(tails + b) + tails[b].n_words;
+        Index n = tails[a].n_words < tails[b].n_words ? tails[a].n_words
+                                                      : tails[b].n_words;
+        for (Index i = 1; i <= n; i++) {
+            if (end_a[-i] != end_b[-i]) {
+                return end_a[-i] < end_b[-i];
+            }
+        }
+        return tails[a].n_words < tails[b].n_words;
+    }
+};
 
-                if (next_prev == tn_idx) {
-                    tn_idx = next;
-                    continue;
-                }
+void _Trie::compact(void)
+{
+    if (image || view) {
+        throw logic_error(READ_ONLY_VIOLATION);
+    }
 
-                if (next_prev) {
-                    assert(next_prev >= ROOT);
+    vector<Index> order;
+    Index n_live_words = 0;
+    for (Index i = 0; i < n_alloced_tails; i++) {
+        if (tails[i].used_by && tails[i].n_words) {
+            order.push_back(i);
+            n_live_words += tails[i].n_words;
+        }
+    }
+    _TailSuffixLess less = { tails, tail_words };
+    sort(order.begin(), order.end(), less);
 
-                    // next node collision
-                    vector<Word> sub1, sub2;
-                    collect_sub_nodes(next_prev, sub1);
-                    collect_sub_nodes(tn_idx, sub2);
-                    if (sub1.size() <= sub2.size()) {
-                        bool tn_idx_changed = false;
-                        // If tn_idx is a sub-node of next_prev,
-                        // tn_idx will be changed after adjusting sub1.
+    // owner[k] is the tail whose words tail order[k] ends with: the last
+    // one of the tails after it in order it is a suffix of, or itself.
+    vector<Index> owner(order.size());
+    Index n_used_words = 0;
+    for (Index k = (Index)order.size() - 1; k >= 0; k--) {
+        if (k + 1 < (Index)order.size()) {
+            const struct _Tail *tail = tails + order[k];
+            const struct _Tail *longer = tails + owner[k + 1];
+            if (tail->n_words <= longer->n_words &&
+                !memcmp(TAIL_WORDS(tail),
+                        TAIL_WORDS(longer) + longer->n_words - tail->n_words,
+                        tail->n_words * sizeof *tail_words)) {
+                owner[k] = owner[k + 1];
+                continue;
+            }
+        }
+        owner[k] = order[k];
+        n_used_words += tails[order[k]].n_words;
+    }
+
+    Word *words = NULL;
+    if (n_used_words) {
+        words = (Word *)alloc_array(n_used_words * sizeof *tail_words);
+        if (!words) {
+            throw bad_alloc();
+        }
+    }
+    // An owner comes after the tails sharing its words, so it is moved
+    // before them.
+    Index n_words = 0;
+    for (Index k = (Index)order.size() - 1; k >= 0; k--) {
+        struct _Tail *tail = tails + order[k];
+        TOUCH_TAIL(tail);
+        if (owner[k] == order[k]) {
+            memcpy(words + n_words, TAIL_WORDS(tail),
+                   tail->n_words * sizeof *tail_words);
+            tail->words = n_words;
+            n_words += tail->n_words;
+        } else {
+            const struct _Tail *longer = tails + owner[k];
+            tail->words = longer->words + longer->n_words - tail->n_words;
+        }
+    }
+    replace_tail_words(words, n_used_words, n_used_words);
+    n_shared_tail_words = n_live_words - n_used_words;
+}
+
+// The lowest base below @limit where all of @subs fit into free cells, or 0.
+// Blocks are tried in order of cells from fitting_blocks[], which a failed
+// block is moved past as find_base() rejects it. Every free cell tried is
+// counted in @n_steps.
+Index _Trie::find_lower_base(const vector<Word>& subs, Index limit,
+                             Index *n_steps)
+{
+    Index n_subs = (Index)subs.size();
+    Index code = CODE(subs[0]);
+    Index n_blocks = n_alloced_nodes / BLOCK_SIZE;
+    Index *fitting = fitting_blocks + n_subs;
+    bool skipped = false; // a block after *fitting may fit
+    for (Index b = *fitting; b < n_blocks; b++) {
+        if (b * BLOCK_SIZE - code >= limit) {
+            break;
+        }
+        struct _Block *block = blocks + b;
+        if (block->n_free < n_subs || n_subs >= block->reject) {
+            if (!skipped) {
+                *fitting = b + 1;
+            }
+            continue;
+        }
+        bool limited = false;
+        Index f = block->head;
+        do {
+            ++*n_steps;
+            Index base = f - code;
+            if (base >= limit) {
+                limited = true;
+            } else if (base >= BASE) {
+                Index i;
+                for (i = 1; i < n_subs; i++) {
+                    Index next = NEXT_INDEX(base, subs[i]);
+                    if (next >= n_alloced_nodes || nodes[next].prev > 0) {
+                        break;
+                    }
+                }
+                if (i == n_subs) {
+                    return base;
+                }
+            }
+            f = FREE_NEXT(f);
+        } while (f != block->head);
+        if (limited) {
+            skipped = true;
+        } else {
+            block->reject = n_subs;
+            if (!skipped) {
+                *fitting = b + 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Free @tn_idx, which erase() left without any sub node, and its parents
+// which have no other sub node.
+void _Trie::prune_node(Index tn_idx)
+{
+    while (tn_idx != ROOT && nodes[tn_idx].base >= BASE &&
+           !first_sub_node(tn_idx)) {
+        Index prev = nodes[tn_idx].prev;
+        unlink_sub_node(prev, tn_idx);
+        free_node(tn_idx);
+        Index b = tn_idx / BLOCK_SIZE;
+        for (Index n = 1; n <= blocks[b].n_free && n < N_FITTING; n++) {
+            if (fitting_blocks[n] > b) {
+                fitting_blocks[n] = b;
+            }
+        }
+        tn_idx = prev;
+    }
+}
+
+// Give back the blocks after the last cell in use.
+void _Trie::shrink_nodes(void)
+{
+    Index last = n_alloced_nodes - 1;
+    while (last > ROOT && nodes[last].prev <= 0) {
+        last--;
+    }
+    Index n_used_blocks = last / BLOCK_SIZE + 1;
+    if (n_used_blocks == n_alloced_nodes / BLOCK_SIZE) {
+        return;
+    }
+    for (Index b = n_used_blocks; b < n_alloced_nodes / BLOCK_SIZE; b++) {
+        pop_block(b);
+    }
+    n_alloced_nodes = n_used_blocks * BLOCK_SIZE;
+    struct TrieNode *shrinked = (struct TrieNode *)resize_region(
+                        NODES_REGION, nodes, n_alloced_nodes * sizeof *nodes);
+    if (shrinked) {
+        nodes = shrinked;
+    }
+    Data *shrinked_max_data = (Data *)resize_region(
+            MAX_DATA_REGION, max_data, n_alloced_nodes * sizeof *max_data);
+    if (shrinked_max_data) {
+        max_data = shrinked_max_data;
+    }
+    if (family) {
+        struct _Family *shrinked_family = (struct _Family *)resize_region(
+                FAMILY_REGION, family, n_alloced_nodes * sizeof *family);
+        if (shrinked_family) {
+            family = shrinked_family;
+        }
+    }
+    struct _Block *shrinked_blocks = (struct _Block *)realloc(blocks,
+                                    n_used_blocks * sizeof *blocks);
+    if (shrinked_blocks) {
+        blocks = shrinked_blocks;
+    }
+}
+
+// Give back the tails after the last one in use, and the tail words of no
+// tail, unless copying words shared by compact() would take more.
+void _Trie::shrink_tails(void)
+{
+    Index n_tails = n_alloced_tails;
+    while (n_tails > 1 && !tails[n_tails - 1].used_by) {
+        n_tails--;
+    }
+    if (n_tails < n_alloced_tails) {
+        struct _Tail *shrinked = (struct _Tail *)resize_region(
+                            TAILS_REGION, tails, n_tails * sizeof *tails);
+        if (shrinked) {
+            tails = shrinked;
+            n_alloced_tails = n_tails;
+            if (next_unused_tail_idx > n_alloced_tails) {
+                next_unused_tail_idx = n_alloced_tails;
+            }
+        }
+    }
+    Index n_live_words = n_live_tail_words();
+    if (n_live_words < n_alloced_tail_words) {
+        compact_tail_words(n_live_words);
+    }
+}
+
+// Cells are visited from the last one down. A node erase() left without sub
+// nodes is freed, and at the first sub node of a parent, all its sub nodes
+// are moved to the lowest base with free cells for all of them. Then tails
+// are moved from the end to the first unused tails. Both go on from where
+// the last call stopped, so a pass may be split into many calls.
+bool _Trie::compact_storage(Index max_steps)
+{
+    if (image || view) {
+        throw logic_error(READ_ONLY_VIOLATION);
+    }
+    drop_links();
+    drop_ranks();
+
+    Index n_steps = 0;
+    if (compacting_node == ROOT) {
+        // Nodes are done, and tails are being moved.
+    } else if (!compacting_node || compacting_node >= n_alloced_nodes) {
+        // Cells erase() frees in the middle of a pass may be left unused.
+        compacting_node = n_alloced_nodes - 1;
+        memset(fitting_blocks, 0, sizeof fitting_blocks);
+    }
+    for (; compacting_node > ROOT; compacting_node--) {
+        if (max_steps && n_steps >= max_steps) {
+            return false;
+        }
+        n_steps++;
+        Index idx = compacting_node;
+        if (nodes[idx].prev <= 0) {
+            continue;
+        }
+        if (nodes[idx].base >= BASE && !first_sub_node(idx)) {
+            prune_node(idx);
+            continue;
+        }
+        // Each family is tried once, at its first sub node.
+        Index prev = nodes[idx].prev;
+        if (idx != first_sub_node(prev)) {
+            continue;
+        }
+        vector<Word> subs;
+        collect_sub_nodes(prev, subs);
+        Index base = find_lower_base(subs, nodes[prev].base, &n_steps);
+        if (base) {
+            move(prev, subs, base - nodes[prev].base);
+            n_steps += (Index)subs.size();
+        }
+    }
+    if (!compacting_tail) {
+        shrink_nodes();
+    }
+
+    if (!compacting_tail || compacting_tail >= n_alloced_tails) {
+        compacting_tail = n_alloced_tails - 1;
+    }
+    for (; compacting_tail > 0; compacting_tail--) {
+        if (max_steps && n_steps >= max_steps) {
+            return false;
+        }
+        n_steps++;
+        struct _Tail *tail = tails + compacting_tail;
+        if (!tail->used_by) {
+            continue;
+        }
+        if (next_unused_tail_idx >= compacting_tail) {
+            break;
+        }
+        Index unused = get_next_unused_tail_idx();
+        TOUCH_TAIL(tails + unused);
+        tails[unused] = *tail;
+        TOUCH_NODE(tail->used_by);
+        nodes[tail->used_by].base = -unused;
+        TOUCH_TAIL(tail);
+        memset(tail, 0, sizeof *tail);
+        set_next_unused_tail_idx(compacting_tail);
+    }
+    shrink_tails();
+    compacting_node = 0;
+    compacting_tail = 0;
+    return true;
+}
+
+// A key takes 1 tail at most, and a node or a tail word for every word, so
+// neither tails nor tail words grow while so many keys are inserted. Cells
+// are not bound by nodes, but free cells left between nodes are rarely more
+// than the words kept in tails.
+void _Trie::reserve(Index n_keys, Index n_words)
+{
+    if (image || view) {
+        throw logic_error(READ_ONLY_VIOLATION);
+    }
+    if (n_words > MAX_NODES - BASE || n_keys > MAX_TAILS ||
+        n_words > MAX_TAIL_WORDS) {
+        throw length_error(INDEX_OVERFLOW);
+    }
+    if (n_words + BASE > n_alloced_nodes) {
+        grow_nodes(n_words + BASE);
+    }
+    if (n_keys > n_alloced_tails) {
+        grow_tails(n_keys);
+    }
+    if (n_words > n_alloced_tail_words) {
+        grow_tail_words(n_words);
+    }
+}
+
+void _Trie::set_growth(double factor, Index chunk)
+{
+    if (!(factor >= 1) || chunk < 0) {
+        throw invalid_argument(GROWTH_VIOLATION);
+    }
+    growth_factor = factor;
+    growth_chunk = chunk;
+}
+
+void _Trie::fill_tail(Index tail_idx, const Word words[], Index n_words,
+                      Data data, Index tn_idx)
+{
+    Index offset = alloc_tail_words(n_words);
+    struct _Tail *tail = tails + tail_idx;
+
+    assert(!tail->used_by);
+    TOUCH_TAIL(tail);
+    tail->words = offset;
+    tail->n_words = n_words;
+    // tail_words is NULL until a tail has words.
+    if (n_words) {
+        TOUCH(TAIL_WORDS_REGION, TAIL_WORDS(tail),
+              n_words * sizeof *tail_words);
+        memcpy(TAIL_WORDS(tail), words, n_words * sizeof *tail_words);
+    }
+    tail->data = data;
+    tail->used_by = tn_idx;
+    n_used_tails++;
+}
+
+void _Trie::free_tail(Index tail_idx)
+{
+    struct _Tail *tail = tails + tail_idx;
+
+    n_garbage_tail_words += tail->n_words;
+    TOUCH_TAIL(tail);
+    memset(tail, 0, sizeof *tail);
+    n_used_tails--;
+    set_next_unused_tail_idx(tail_idx);
+
+    // Give memory back when most of tail_words is garbage.
+    Index n_live_words = n_live_tail_words();
+    if (n_garbage_tail_words > PRE_ALLOCED_WORDS &&
+        n_garbage_tail_words > (n_live_words << 1)) {
+        compact_tail_words(n_live_words << 1);
+    }
+}
+
+void _Trie::insert(const Word words[], Index n_words, Data data)
+{
+    insert_key(words, n_words, data);
+    if (reversed) {
+        insert_reversed(words, n_words, data);
+    }
+}
+
+void _Trie::insert_key(const Word words[], Index n_words, Data data)
+{
+    if (image || view) {
+        throw logic_error(READ_ONLY_VIOLATION);
+    }
+
+    struct _Tail *tail;
+    if (search(words, n_words, &tail)) {
+        Data old_data = tail->data;
+        TOUCH_TAIL(tail);
+        tail->data = data;
+        SET_MAX_DATA(tail->used_by, data);
+        if (data > old_data) {
+            raise_max_data(nodes[tail->used_by].prev, data);
+        } else if (data < old_data) {
+            update_max_data(nodes[tail->used_by].prev);
+        }
+        return;
+    }
+
+    drop_links();
+    drop_ranks();
+    Index tn_idx = ROOT;
+    for (Index i = 0; i < n_words; i++) {
+        Index base = nodes[tn_idx].base;
+        Index next;
+
+        if (base >= BASE) {
+            next = NEXT_INDEX(base, words[i]);
+            if (EXPECT(next >= n_alloced_nodes, 0)) {
+                expand_nodes(next);
+            } else {
+                Index next_prev = nodes[next].prev;
+
+                if (next_prev == tn_idx) {
+                    tn_idx = next;
+                    continue;
+                }
+
+                if (next_prev > 0) {
+                    assert(next_prev >= ROOT);
+
+                    // next node collision
+                    COUNT(collisions, 1);
+                    vector<Word> sub1, sub2;
+                    collect_sub_nodes(next_prev, sub1);
+                    collect_sub_nodes(tn_idx, sub2);
+                    if (sub1.size() <= sub2.size()) {
+                        bool tn_idx_changed = false;
+                        // If tn_idx is a sub-node of next_prev,
+                        // tn_idx will be changed after adjusting sub1.
                         if (nodes[tn_idx].prev == next_prev) {
                             tn_idx_changed = true;
                         }
@@ -290,14 +1659,14 @@ void _Trie::insert(const Word words[], Index n_words, Index data)
                     }
                 }
             }
-            assert(!nodes[next].prev);
+            use_node(next);
             nodes[next].prev = tn_idx;
+            link_sub_node(tn_idx, next);
             Index tail_idx = get_next_unused_tail_idx();
             fill_tail(tail_idx, words + i + 1, n_words - i - 1, data, next);
             nodes[next].base = -tail_idx;
-#ifdef START_BASE_OPTIMIZATION
-            inc_next_unused_node_idx(next);
-#endif
+            SET_MAX_DATA(next, data);
+            raise_max_data(tn_idx, data);
             return;
         } else {
             assert(base <= 0);
@@ -307,31 +1676,20 @@ void _Trie::insert(const Word words[], Index n_words, Index data)
             Index j = 0;
 
             while (j < tail->n_words && i < n_words) {
-                if (tail->words[j] != words[i]) {
+                if (TAIL_WORDS(tail)[j] != words[i]) {
                     break;
                 }
-                for (
-#ifdef START_BASE_OPTIMIZATION
-                     next = next_unused_node_idx;
-#else
-                     next = NEXT_INDEX(BASE, words[i]);
-#endif
-                     EXPECT(next < n_alloced_nodes, 1);
-                     next++) {
-                    if (!nodes[next].prev) {
-                        break;
-                    }
-                }
+                next = NEXT_INDEX(find_base(words + i, 1), words[i]);
                 if (EXPECT(next >= n_alloced_nodes, 0)) {
                     expand_nodes(next);
                 }
-                nodes[tn_idx].base = next - words[i];
-                assert(!nodes[next].prev);
+                TOUCH_NODE(tn_idx);
+                nodes[tn_idx].base = next - CODE(words[i]);
+                use_node(next);
                 nodes[next].prev = tn_idx;
+                link_sub_node(tn_idx, next);
+                SET_MAX_DATA(next, tail->data);
                 tn_idx = next;
-#ifdef START_BASE_OPTIMIZATION
-                inc_next_unused_node_idx(next);
-#endif
 
                 j++;
                 i++;
@@ -339,75 +1697,51 @@ void _Trie::insert(const Word words[], Index n_words, Index data)
             if (j == tail->n_words || i == n_words) {
                 assert(!(j == tail->n_words && i == n_words));
                 // Recovery.
+                TOUCH_NODE(tn_idx);
                 nodes[tn_idx].base = (Index)-(tail - tails);
+                TOUCH_TAIL(tail);
                 tail->used_by = tn_idx;
+                tail->words += j;
                 tail->n_words -= j;
-                if (tail->n_words) {
-                    memmove(tail->words, tail->words + j,
-                            tail->n_words * sizeof *tail->words);
-                    tail->words = (Word *)realloc(tail->words,
-                                           tail->n_words * sizeof *tail->words);
-                    // We consider this realloc() should always succeed.
-                    assert(tail->words);
-                } else {
-                    free(tail->words);
-                    tail->words = NULL;
-                }
+                n_garbage_tail_words += j;
                 throw invalid_argument(INVARIANT_VIOLATION);
             }
 
-            for (
-#ifdef START_BASE_OPTIMIZATION
-                 base = next_unused_node_idx -
-                        (tail->words[j] < words[i] ? tail->words[j] : words[i]);
-#else
-                 base = BASE;
-#endif
-                 (EXPECT(NEXT_INDEX(base, tail->words[j]) < n_alloced_nodes, 1) &&
-                  NEXT_NODE(base, tail->words[j]).prev) ||
-                 (EXPECT(NEXT_INDEX(base, words[i]) < n_alloced_nodes, 1) &&
-                  NEXT_NODE(base, words[i]).prev);
-                 base++);
+            COUNT(tail_splits, 1);
+            Word split_words[2] = { TAIL_WORDS(tail)[j], words[i] };
+            base = find_base(split_words, 2);
 
-            if (EXPECT(NEXT_INDEX(base, tail->words[j]) >= n_alloced_nodes, 0)) {
-                expand_nodes(NEXT_INDEX(base, tail->words[j]));
+            if (EXPECT(NEXT_INDEX(base, TAIL_WORDS(tail)[j]) >= n_alloced_nodes, 0)) {
+                expand_nodes(NEXT_INDEX(base, TAIL_WORDS(tail)[j]));
             }
             if (EXPECT(NEXT_INDEX(base, words[i]) >= n_alloced_nodes, 0)) {
                 expand_nodes(NEXT_INDEX(base, words[i]));
             }
 
+            TOUCH_NODE(tn_idx);
             nodes[tn_idx].base = base;
 
-            next = NEXT_INDEX(base, tail->words[j]);
-            assert(!nodes[next].prev);
+            next = NEXT_INDEX(base, TAIL_WORDS(tail)[j]);
+            use_node(next);
             nodes[next].prev = tn_idx;
             nodes[next].base = (Index)-(tail - tails);
+            link_sub_node(tn_idx, next);
+            SET_MAX_DATA(next, tail->data);
+            TOUCH_TAIL(tail);
             tail->used_by = next;
+            tail->words += j + 1;
             tail->n_words -= j + 1;
-            if (tail->n_words) {
-                memmove(tail->words, tail->words + j + 1,
-                        tail->n_words * sizeof *tail->words);
-                tail->words = (Word *)realloc(tail->words,
-                                           tail->n_words * sizeof *tail->words);
-                // We consider this realloc() should always succeed.
-                assert(tail->words);
-            } else {
-                free(tail->words);
-                tail->words = NULL;
-            }
-#ifdef START_BASE_OPTIMIZATION
-            inc_next_unused_node_idx(next);
-#endif
+            n_garbage_tail_words += j + 1;
 
             next = NEXT_INDEX(base, words[i]);
-            assert(!nodes[next].prev);
+            use_node(next);
             nodes[next].prev = tn_idx;
+            link_sub_node(tn_idx, next);
             Index tail_idx = get_next_unused_tail_idx();
             nodes[next].base = -tail_idx;
             fill_tail(tail_idx, words + i + 1, n_words - i - 1, data, next);
-#ifdef START_BASE_OPTIMIZATION
-            inc_next_unused_node_idx(next);
-#endif
+            SET_MAX_DATA(next, data);
+            raise_max_data(tn_idx, data);
 
             return;
         }
@@ -417,58 +1751,17 @@ void _Trie::insert(const Word words[], Index n_words, Index data)
 
 void _Trie::adjust(Index tn_idx, const vector<Word>& subs)
 {
-    Index subs_size = (Index)subs.size();
-    assert(subs_size);
-
-#ifdef INC_BASE_WHEN_COLLISION
-    Index base = nodes[tn_idx].base + 1;
-#elif defined(START_BASE_OPTIMIZATION)
-    Index base = next_unused_node_idx;
-#else
-    Index base = BASE;
-#endif
-    for (Index i = 0; i < subs_size;) {
-        Index next = NEXT_INDEX(base, subs[i]);
-        if (EXPECT(next < n_alloced_nodes, 1) && nodes[next].prev) {
-            base++;
-            i = 0;
-        } else {
-            i++;
-        }
-    }
+    assert(subs.size());
 
+    Index base = find_base(&subs[0], (Index)subs.size());
     move(tn_idx, subs, base - nodes[tn_idx].base);
 }
 
 void _Trie::adjust(Index tn_idx, const vector<Word>& subs, const Word& word)
 {
-#ifdef INC_BASE_WHEN_COLLISION
-    Index base = nodes[tn_idx].base + 1;
-#elif defined(START_BASE_OPTIMIZATION)
-    Index base = next_unused_node_idx;
-#else
-    Index base = BASE;
-#endif
-    while (1) {
-        Index next = NEXT_INDEX(base, word);
-        while (EXPECT(next < n_alloced_nodes, 1) && nodes[next].prev) {
-            base++;
-            next++;
-        }
-        Index i;
-        Index subs_size = (Index)subs.size();
-        for (i = 0; i < subs_size; i++) {
-            next = NEXT_INDEX(base, subs[i]);
-            if (EXPECT(next < n_alloced_nodes, 1) && nodes[next].prev) {
-                base++;
-                break;
-            }
-        }
-        if (i == subs_size) {
-            break;
-        }
-    }
-
+    vector<Word> words(subs);
+    words.push_back(word);
+    Index base = find_base(&words[0], (Index)words.size());
     move(tn_idx, subs, base - nodes[tn_idx].base);
 }
 
@@ -477,48 +1770,171 @@ void _Trie::move(Index tn_idx, const vector<Word>& subs, Index offset)
     assert(offset);
 
     Index subs_size = (Index)subs.size();
+    COUNT(relocations, 1);
+    COUNT(relocated_nodes, subs_size);
     for (Index i = 0; i < subs_size; i++) {
         Index base = NEXT_NODE(nodes[tn_idx].base, subs[i]).base;
         vector<Word> sub_subs;
         collect_sub_nodes(NEXT_INDEX(nodes[tn_idx].base, subs[i]), sub_subs);
         Index sub_subs_size = (Index)sub_subs.size();
         for (Index j = 0; j < sub_subs_size; j++) {
-            nodes[base + sub_subs[j]].prev += offset;
+            TOUCH_NODE(NEXT_INDEX(base, sub_subs[j]));
+            NEXT_NODE(base, sub_subs[j]).prev += offset;
         }
         Index next = NEXT_INDEX(nodes[tn_idx].base + offset, subs[i]);
         if (EXPECT(next >= n_alloced_nodes, 0)) {
             expand_nodes(next);
         }
+        use_node(next);
         nodes[next] = nodes[next - offset];
+        SET_MAX_DATA(next, max_data[next - offset]);
+        if (family) {
+            TOUCH_FAMILY(next);
+            family[next] = family[next - offset];
+        }
         if (nodes[next].base <= 0) {
             assert(-nodes[next].base < n_alloced_tails);
             assert(tails[-nodes[next].base].used_by == next - offset);
+            TOUCH_TAIL(tails - nodes[next].base);
             tails[-nodes[next].base].used_by = next;
         }
-        nodes[next - offset].base = 0;
-        nodes[next - offset].prev = 0;
-#ifdef START_BASE_OPTIMIZATION
-        dec_next_unused_node_idx(next - offset);
-        inc_next_unused_node_idx(next);
-#endif
+        free_node(next - offset);
     }
+    TOUCH_NODE(tn_idx);
     nodes[tn_idx].base += offset;
 }
 
 void _Trie::collect_sub_nodes(Index tn_idx, vector<Word>& subs) const
 {
-    if (nodes[tn_idx].base >= BASE) {
-        for (Index i = 0; i <= (Word)(~0ULL); i++) {
-            Index next = NEXT_INDEX(nodes[tn_idx].base, i);
-            if (EXPECT(next < n_alloced_nodes, 1) && nodes[next].prev == tn_idx) {
-                subs.push_back((Word)i);
-            }
+    Index base = nodes[tn_idx].base;
+    if (base >= BASE) {
+        for (Index next = first_sub_node(tn_idx); next;
+             next = next_sub_node(tn_idx, next)) {
+            subs.push_back(WORD_OF(next - base));
+        }
+    }
+}
+
+// Sub nodes are walked through in ascending order of words by
+// first_sub_node() and next_sub_node(), which return 0 when there is no more.
+Index _Trie::first_sub_node(Index tn_idx) const
+{
+    assert(nodes[tn_idx].base >= BASE);
+#ifdef CHILD_INDEX
+    if (EXPECT(family != NULL, 1)) {
+        Index child = family[tn_idx].child;
+        return child ? NEXT_INDEX(nodes[tn_idx].base, child - 1) : 0;
+    }
+#endif
+    return scan_sub_node(tn_idx, 0);
+}
+
+Index _Trie::next_sub_node(Index tn_idx, Index sub) const
+{
+#ifdef CHILD_INDEX
+    if (EXPECT(family != NULL, 1)) {
+        Index sibling = family[sub].sibling;
+        return sibling ? NEXT_INDEX(nodes[tn_idx].base, sibling - 1) : 0;
+    }
+#endif
+    return scan_sub_node(tn_idx, WORD_OF(sub - nodes[tn_idx].base) + 1);
+}
+
+// The first sub node of @tn_idx with a word not less than @from.
+Index _Trie::scan_sub_node(Index tn_idx, Index from) const
+{
+    Index base = nodes[tn_idx].base;
+    for (Index word = from; word <= (Word)(~0ULL); word++) {
+        Index next = NEXT_INDEX(base, word);
+        if (next < n_alloced_nodes && nodes[next].prev == tn_idx) {
+            return next;
+        }
+    }
+    return 0;
+}
+
+// last_sub_node() and prev_sub_node() walk through sub nodes the other way.
+// Sibling lists are single linked, so a predecessor is found from the head.
+Index _Trie::last_sub_node(Index tn_idx) const
+{
+    return prev_sub_node(tn_idx, 0);
+}
+
+Index _Trie::prev_sub_node(Index tn_idx, Index sub) const
+{
+    Index base = nodes[tn_idx].base;
+    assert(base >= BASE);
+#ifdef CHILD_INDEX
+    if (EXPECT(family != NULL, 1)) {
+        Index prev = 0;
+        for (Index next = first_sub_node(tn_idx); next != sub;
+             next = next_sub_node(tn_idx, next)) {
+            prev = next;
+        }
+        return prev;
+    }
+#endif
+    Index word = sub ? (Index)WORD_OF(sub - base) - 1 : (Word)(~0ULL);
+    for (; word >= 0; word--) {
+        Index prev = NEXT_INDEX(base, word);
+        if (prev < n_alloced_nodes && nodes[prev].prev == tn_idx) {
+            return prev;
         }
     }
+    return 0;
+}
+
+// Add new sub node @sub to the sibling list of @tn_idx.
+void _Trie::link_sub_node(Index tn_idx, Index sub)
+{
+    if (!family) {
+        return;
+    }
+    Index base = nodes[tn_idx].base;
+    unsigned short word = (unsigned short)(WORD_OF(sub - base) + 1);
+    unsigned short *link = &family[tn_idx].child;
+    Index owner = tn_idx;
+    while (*link && *link < word) {
+        owner = NEXT_INDEX(base, *link - 1);
+        link = &family[owner].sibling;
+    }
+    TOUCH_FAMILY(sub);
+    family[sub].child = 0;
+    family[sub].sibling = *link;
+    TOUCH_FAMILY(owner);
+    *link = word;
+}
+
+// Remove sub node @sub from the sibling list of @tn_idx.
+void _Trie::unlink_sub_node(Index tn_idx, Index sub)
+{
+    if (!family) {
+        return;
+    }
+    Index base = nodes[tn_idx].base;
+    unsigned short word = (unsigned short)(WORD_OF(sub - base) + 1);
+    unsigned short *link = &family[tn_idx].child;
+    Index owner = tn_idx;
+    while (*link != word) {
+        assert(*link);
+        owner = NEXT_INDEX(base, *link - 1);
+        link = &family[owner].sibling;
+    }
+    TOUCH_FAMILY(owner);
+    *link = family[sub].sibling;
 }
 
 void _Trie::erase(const Word words[], Index n_words)
 {
+    if (image || view) {
+        throw logic_error(READ_ONLY_VIOLATION);
+    }
+    drop_links();
+    drop_ranks();
+    if (reversed) {
+        erase_reversed(words, n_words);
+    }
+
     Index tn_idx = ROOT;
     for (Index i = 0; i < n_words; i++) {
         Index base = nodes[tn_idx].base;
@@ -536,7 +1952,7 @@ void _Trie::erase(const Word words[], Index n_words)
             Index j = 0;
 
             while (j < tail->n_words && i < n_words) {
-                if (tail->words[j] != words[i]) {
+                if (TAIL_WORDS(tail)[j] != words[i]) {
                     break;
                 }
                 j++;
@@ -545,14 +1961,11 @@ void _Trie::erase(const Word words[], Index n_words)
             if (i < n_words) {
                 return;
             }
-            free(tail->words);
-            memset(tail, 0, sizeof *tail);
-            nodes[tn_idx].base = 0;
-            nodes[tn_idx].prev = 0;
-            set_next_unused_tail_idx(-base);
-#ifdef START_BASE_OPTIMIZATION
-            dec_next_unused_node_idx(tn_idx);
-#endif
+            free_tail(-base);
+            Index prev = nodes[tn_idx].prev;
+            unlink_sub_node(prev, tn_idx);
+            free_node(tn_idx);
+            update_max_data(prev);
             return;
         }
     }
@@ -561,53 +1974,98 @@ void _Trie::erase(const Word words[], Index n_words)
     if (base <= 0) {
         assert(-base < n_alloced_tails);
 
-        struct _Tail *tail = tails - base;
-        free(tail->words);
-        memset(tail, 0, sizeof *tail);
-        nodes[tn_idx].base = 0;
-        nodes[tn_idx].prev = 0;
-        set_next_unused_tail_idx(-base);
-#ifdef START_BASE_OPTIMIZATION
-        dec_next_unused_node_idx(tn_idx);
-#endif
+        free_tail(-base);
+        Index prev = nodes[tn_idx].prev;
+        unlink_sub_node(prev, tn_idx);
+        free_node(tn_idx);
+        update_max_data(prev);
         return;
     }
 
     erase_all_subs(tn_idx);
     if (tn_idx != ROOT) {
-        nodes[tn_idx].base = 0;
-        nodes[tn_idx].prev = 0;
-#ifdef START_BASE_OPTIMIZATION
-        dec_next_unused_node_idx(tn_idx);
-#endif
+        Index prev = nodes[tn_idx].prev;
+        unlink_sub_node(prev, tn_idx);
+        free_node(tn_idx);
+        update_max_data(prev);
+    } else {
+        SET_MAX_DATA(ROOT, NO_DATA);
     }
 }
 
-void _Trie::erase_all_subs(Index tn_idx)
+Data _Trie::sub_max_data(Index tn_idx) const
 {
-    vector<Word> subs;
-    collect_sub_nodes(tn_idx, subs);
-    Index subs_size = (Index)subs.size();
-    for (Index i = 0; i < subs_size; i++) {
-        Index next = NEXT_INDEX(nodes[tn_idx].base, subs[i]);
-        Index base = nodes[next].base;
-
-        if (base >= BASE) {
-            erase_all_subs(next);
-        } else {
-            assert(base <= 0);
-            assert(-base < n_alloced_tails);
+    Index base = nodes[tn_idx].base;
+    if (base <= 0) {
+        assert(-base < n_alloced_tails);
+        return tails[-base].data;
+    }
 
-            struct _Tail *tail = tails - base;
-            free(tail->words);
-            memset(tail, 0, sizeof *tail);
-            set_next_unused_tail_idx(-base);
-        }
-        nodes[next].base = 0;
-        nodes[next].prev = 0;
-#ifdef START_BASE_OPTIMIZATION
-        dec_next_unused_node_idx(next);
-#endif
+    Data value = NO_DATA;
+    for (Index next = first_sub_node(tn_idx); next;
+         next = next_sub_node(tn_idx, next)) {
+        if (max_data[next] > value) {
+            value = max_data[next];
+        }
+    }
+    return value;
+}
+
+// A key with @data is added to the subtree of @tn_idx.
+void _Trie::raise_max_data(Index tn_idx, Data data)
+{
+    for (; tn_idx && max_data[tn_idx] < data; tn_idx = nodes[tn_idx].prev) {
+        SET_MAX_DATA(tn_idx, data);
+    }
+}
+
+// Some keys are removed from the subtree of @tn_idx, or their data is reduced.
+void _Trie::update_max_data(Index tn_idx)
+{
+    for (; tn_idx; tn_idx = nodes[tn_idx].prev) {
+        Data value = sub_max_data(tn_idx);
+        if (value == max_data[tn_idx]) {
+            break;
+        }
+        SET_MAX_DATA(tn_idx, value);
+    }
+}
+
+void _Trie::init_max_data(void)
+{
+    TOUCH(MAX_DATA_REGION, max_data, n_alloced_nodes * sizeof *max_data);
+    for (Index i = 0; i < n_alloced_nodes; i++) {
+        max_data[i] = NO_DATA;
+    }
+    for (Index i = 0; i < n_alloced_tails; i++) {
+        if (tails[i].used_by) {
+            raise_max_data(tails[i].used_by, tails[i].data);
+        }
+    }
+}
+
+void _Trie::erase_all_subs(Index tn_idx)
+{
+    vector<Word> subs;
+    collect_sub_nodes(tn_idx, subs);
+    Index subs_size = (Index)subs.size();
+    for (Index i = 0; i < subs_size; i++) {
+        Index next = NEXT_INDEX(nodes[tn_idx].base, subs[i]);
+        Index base = nodes[next].base;
+
+        if (base >= BASE) {
+            erase_all_subs(next);
+        } else {
+            assert(base <= 0);
+            assert(-base < n_alloced_tails);
+
+            free_tail(-base);
+        }
+        free_node(next);
+    }
+    if (family) {
+        TOUCH_FAMILY(tn_idx);
+        family[tn_idx].child = 0;
     }
 }
 
@@ -618,13 +2076,13 @@ bool _Trie::search(const Word words[], Index n_words,
 }
 
 bool _Trie::search(const Word words[], Index n_words,
-                   Index *data, Index *unmatch) const
+                   Data *data, Index *unmatch) const
 {
     return search(words, n_words, NULL, data, unmatch);
 }
 
 bool _Trie::search(const Word words[], Index n_words,
-                   struct _Tail **tailp, Index *data, Index *unmatch) const
+                   struct _Tail **tailp, Data *data, Index *unmatch) const
 {
     Index tn_idx = ROOT;
     for (Index i = 0; i < n_words; i++) {
@@ -646,7 +2104,7 @@ bool _Trie::search(const Word words[], Index n_words,
             Index j = 0;
 
             while (j < tail->n_words && i < n_words) {
-                if (tail->words[j] != words[i]) {
+                if (TAIL_WORDS(tail)[j] != words[i]) {
                     break;
                 }
                 j++;
@@ -695,8 +2153,101 @@ bool _Trie::search(const Word words[], Index n_words,
     }
 }
 
+// Walk SEARCH_BATCH_WIDTH keys in turn, one step each round. A step
+// prefetches what the next step of the same key needs, so the cache misses
+// of different keys overlap instead of waiting one after another.
+void _Trie::search_batch(const Word *const words[], const Index n_words[],
+                         Index n, Data data[], bool found[]) const
+{
+    enum { NODE, NEXT, TAIL, TAIL_WORDS, DONE };
+    struct Lane {
+        int state;
+        Index k;      // which key
+        Index i;      // words[k][i] is the next word to match
+        Index tn_idx;
+        Index next;   // the node tn_idx may go to (checked in NEXT)
+    } lanes[SEARCH_BATCH_WIDTH];
+    Index n_lanes = n < SEARCH_BATCH_WIDTH ? n : SEARCH_BATCH_WIDTH;
+    Index next_k = 0;
+
+    for (Index l = 0; l < n_lanes; l++) {
+        lanes[l].state = NODE;
+        lanes[l].k = next_k++;
+        lanes[l].i = 0;
+        lanes[l].tn_idx = ROOT;
+    }
+    Index n_active_lanes = n_lanes;
+    while (n_active_lanes) {
+        for (Index l = 0; l < n_lanes; l++) {
+            struct Lane *lane = lanes + l;
+            Index k = lane->k;
+            bool result = false;
+
+            switch (lane->state) {
+            case NEXT:
+                if (EXPECT(lane->next >= n_alloced_nodes, 0) ||
+                    nodes[lane->next].prev != lane->tn_idx) {
+                    break;
+                }
+                lane->tn_idx = lane->next;
+                lane->i++;
+                // fall through
+            case NODE: {
+                Index base = nodes[lane->tn_idx].base;
+                if (base >= BASE) {
+                    if (lane->i == n_words[k]) {
+                        break;
+                    }
+                    lane->next = NEXT_INDEX(base, words[k][lane->i]);
+                    PREFETCH(nodes + lane->next);
+                    lane->state = NEXT;
+                } else {
+                    assert(-base < n_alloced_tails);
+
+                    lane->next = -base;
+                    PREFETCH(tails + lane->next);
+                    lane->state = TAIL;
+                }
+                continue;
+            }
+            case TAIL:
+                PREFETCH(TAIL_WORDS(tails + lane->next));
+                lane->state = TAIL_WORDS;
+                continue;
+            case TAIL_WORDS: {
+                struct _Tail *tail = tails + lane->next;
+                if (tail->n_words == n_words[k] - lane->i &&
+                    (!tail->n_words ||
+                     !memcmp(TAIL_WORDS(tail), words[k] + lane->i,
+                             tail->n_words * sizeof *tail_words))) {
+                    if (data) {
+                        data[k] = tail->data;
+                    }
+                    result = true;
+                }
+                break;
+            }
+            default:
+                continue;
+            }
+
+            // Key k is done, take the next one.
+            found[k] = result;
+            if (next_k < n) {
+                lane->state = NODE;
+                lane->k = next_k++;
+                lane->i = 0;
+                lane->tn_idx = ROOT;
+            } else {
+                lane->state = DONE;
+                n_active_lanes--;
+            }
+        }
+    }
+}
+
 bool _Trie::segment_max_match(const Word words[], Index n_words, Word end_word,
-                              Index *data, Index *unmatch) const
+                              Data *data, Index *unmatch) const
 {
     bool find_one = false;
     Index tn_idx = ROOT;
@@ -733,11 +2284,11 @@ bool _Trie::segment_max_match(const Word words[], Index n_words, Word end_word,
             struct _Tail *tail = tails - base;
             Index j = 0;
 
-            if (!tail->n_words || tail->words[tail->n_words - 1] != end_word) {
+            if (!tail->n_words || TAIL_WORDS(tail)[tail->n_words - 1] != end_word) {
                 return find_one;
             }
             while (j < tail->n_words - 1 && i < n_words) {
-                if (tail->words[j] != words[i]) {
+                if (TAIL_WORDS(tail)[j] != words[i]) {
                     break;
                 }
                 j++;
@@ -780,7 +2331,7 @@ bool _Trie::segment_max_match(const Word words[], Index n_words, Word end_word,
         assert(-base < n_alloced_tails);
 
         struct _Tail *tail = tails - base;
-        if (tail->n_words == 1 && tail->words[0] == end_word) {
+        if (tail->n_words == 1 && TAIL_WORDS(tail)[0] == end_word) {
             if (data) {
                 *data = tail->data;
             }
@@ -794,7 +2345,7 @@ bool _Trie::segment_max_match(const Word words[], Index n_words, Word end_word,
 }
 
 bool _Trie::segment_min_match(const Word words[], Index n_words, Word end_word,
-                              Index *data, Index *unmatch) const
+                              Data *data, Index *unmatch) const
 {
     Index tn_idx = ROOT;
     for (Index i = 0; i < n_words; i++) {
@@ -830,11 +2381,11 @@ bool _Trie::segment_min_match(const Word words[], Index n_words, Word end_word,
             struct _Tail *tail = tails - base;
             Index j = 0;
 
-            if (!tail->n_words || tail->words[tail->n_words - 1] != end_word) {
+            if (!tail->n_words || TAIL_WORDS(tail)[tail->n_words - 1] != end_word) {
                 return false;
             }
             while (j < tail->n_words - 1 && i < n_words) {
-                if (tail->words[j] != words[i]) {
+                if (TAIL_WORDS(tail)[j] != words[i]) {
                     break;
                 }
                 j++;
@@ -877,7 +2428,7 @@ bool _Trie::segment_min_match(const Word words[], Index n_words, Word end_word,
         assert(-base < n_alloced_tails);
 
         struct _Tail *tail = tails - base;
-        if (tail->n_words == 1 && tail->words[0] == end_word) {
+        if (tail->n_words == 1 && TAIL_WORDS(tail)[0] == end_word) {
             if (data) {
                 *data = tail->data;
             }
@@ -890,210 +2441,2355 @@ bool _Trie::segment_min_match(const Word words[], Index n_words, Word end_word,
     return false;
 }
 
-void _Trie::prefix(const Word words[], Index n_words, vector<Index>& results) const
+// Words of the UTF-8 character at @text, at most @n_words. Bytes which
+// are not a valid character are taken as characters too.
+static Index char_words(const Word text[], Index n_words)
+{
+    Index i = 1;
+    while (i < n_words && (text[i] & 0xc0) == 0x80) {
+        i++;
+    }
+    return i;
+}
+
+#define CHAR_BEGINS(text, n_words, i) \
+            ((i) == (n_words) || ((text)[i] & 0xc0) != 0x80)
+
+// Find every key ending with @end_word which is a prefix of @words.
+Index _Trie::common_prefix_search(const Word words[], Index n_words,
+                                  Word end_word, Match results[],
+                                  Index max_results) const
 {
+    Index n_results = 0;
     Index tn_idx = ROOT;
-    for (Index i = 0; i < n_words; i++) {
+    for (Index i = 0; ; i++) {
         Index base = nodes[tn_idx].base;
         if (base >= BASE) {
+            Index end = NEXT_INDEX(base, end_word);
+            if (EXPECT(end < n_alloced_nodes, 1) && nodes[end].prev == tn_idx) {
+                Index end_base = nodes[end].base;
+                if (EXPECT(end_base <= 0, 1)) {
+                    assert(-end_base < n_alloced_tails);
+
+                    struct _Tail *tail = tails - end_base;
+                    if (EXPECT(!tail->n_words, 1)) {
+                        if (n_results < max_results) {
+                            results[n_results].n_words = i;
+                            results[n_results].data = tail->data;
+                        }
+                        n_results++;
+                    }
+                }
+            }
+            if (i == n_words) {
+                return n_results;
+            }
             Index next = NEXT_INDEX(base, words[i]);
             if (EXPECT(next >= n_alloced_nodes, 0) || nodes[next].prev != tn_idx) {
-                return;
+                return n_results;
             }
             tn_idx = next;
         } else {
             assert(base <= 0);
             assert(-base < n_alloced_tails);
 
+            // The only key left, if the rest of words begin with its tail.
             struct _Tail *tail = tails - base;
-            Index j = 0;
-
-            while (j < tail->n_words && i < n_words) {
-                if (tail->words[j] != words[i]) {
-                    break;
-                }
-                j++;
-                i++;
+            Index n_tail_words = tail->n_words - 1;
+            if (n_tail_words < 0 || TAIL_WORDS(tail)[n_tail_words] != end_word ||
+                n_tail_words > n_words - i ||
+                memcmp(TAIL_WORDS(tail), words + i, n_tail_words * sizeof(Word))) {
+                return n_results;
             }
-            if (i < n_words) {
-                return;
+            if (n_results < max_results) {
+                results[n_results].n_words = i + n_tail_words;
+                results[n_results].data = tail->data;
             }
-
-            results.push_back(tail->data);
-            return;
+            return n_results + 1;
         }
     }
+}
 
-    Index base = nodes[tn_idx].base;
-    if (base <= 0) {
-        assert(-base < n_alloced_tails);
+// @key is @words with the words before @end_word reversed, if @words ends
+// with @end_word.
+static bool reverse_key(const Word words[], Index n_words, Word end_word,
+                        vector<Word>& key)
+{
+    if (!n_words || words[n_words - 1] != end_word) {
+        return false;
+    }
+    key.assign(words, words + n_words);
+    reverse(key.begin(), key.end() - 1);
+    return true;
+}
 
-        struct _Tail *tail = tails - base;
-        results.push_back(tail->data);
-        return;
+const _Trie *_Trie::reversed_trie(Word end_word) const
+{
+    for (struct _Reversed *r = reversed; r; r = r->next) {
+        if (r->end_word == end_word) {
+            return r->trie;
+        }
     }
+    throw logic_error(NO_REVERSED_VIOLATION);
+}
 
-    assert(base >= BASE);
+// Reversed keys of all keys ending with @end_word, for backward segment().
+// Built once from all keys; insert() and erase() keep them since.
+void _Trie::build_reversed(Word end_word)
+{
+    for (struct _Reversed *r = reversed; r; r = r->next) {
+        if (r->end_word == end_word) {
+            return;
+        }
+    }
 
-    collect_all_subs(tn_idx, results);
+    struct _Reversed *r = new _Reversed;
+    r->end_word = end_word;
+    r->trie = NULL;
+    try {
+        r->trie = new _Trie;
+        vector<Word> key;
+        struct _PrefixIterator iter;
+        first_prefix(&iter, NULL, 0);
+        const Word *words;
+        Index n_words;
+        Data data;
+        while (next_prefix(&iter, &words, &n_words, &data)) {
+            if (reverse_key(words, n_words, end_word, key)) {
+                r->trie->insert(&key[0], n_words, data);
+            }
+        }
+    } catch (...) {
+        delete r->trie;
+        delete r;
+        throw;
+    }
+    r->next = reversed;
+    reversed = r;
 }
 
-void _Trie::collect_all_subs(Index tn_idx, vector<Index>& results) const
+// Keep reversed keys in step with insert(). If that fails, they are
+// dropped, and build_reversed() should be called again.
+void _Trie::insert_reversed(const Word words[], Index n_words, Data data)
 {
-    vector<Word> subs;
-    collect_sub_nodes(tn_idx, subs);
-    Index subs_size = (Index)subs.size();
-    for (Index i = 0; i < subs_size; i++) {
-        Index next = NEXT_INDEX(nodes[tn_idx].base, subs[i]);
-        Index base = nodes[next].base;
-
-        if (base >= BASE) {
-            collect_all_subs(next, results);
-        } else {
-            assert(base <= 0);
-            assert(-base < n_alloced_tails);
+    try {
+        vector<Word> key;
+        for (struct _Reversed *r = reversed; r; r = r->next) {
+            if (reverse_key(words, n_words, r->end_word, key)) {
+                r->trie->insert(&key[0], n_words, data);
+            }
+        }
+    } catch (...) {
+        drop_reversed();
+    }
+}
 
-            struct _Tail *tail = tails - base;
-            results.push_back(tail->data);
+// Erase the reversed keys of every key erase() is going to erase.
+void _Trie::erase_reversed(const Word words[], Index n_words)
+{
+    try {
+        vector<Word> key;
+        struct _PrefixIterator iter;
+        first_prefix(&iter, words, n_words);
+        const Word *key_words;
+        Index n_key_words;
+        Data data;
+        while (next_prefix(&iter, &key_words, &n_key_words, &data)) {
+            for (struct _Reversed *r = reversed; r; r = r->next) {
+                if (reverse_key(key_words, n_key_words, r->end_word, key)) {
+                    r->trie->erase(&key[0], n_key_words);
+                }
+            }
         }
+    } catch (...) {
+        drop_reversed();
     }
 }
 
-void _Trie::prefix(const Word words[], Index n_words, vector<Tail>& results) const
+void _Trie::drop_reversed(void)
+{
+    while (reversed) {
+        struct _Reversed *next = reversed->next;
+        delete reversed->trie;
+        delete reversed;
+        reversed = next;
+    }
+}
+
+// The token at @begin by forward maximum matching: the longest key there,
+// or else one character. Return whether it is a single character.
+bool _Trie::forward_token(const Word text[], Index n_words, Index begin,
+                          Word end_word, Token *token) const
+{
+    Index n_char_words = char_words(text + begin, n_words - begin);
+    Index n_matched;
+    token->begin = begin;
+    if (segment_max_match(text + begin, n_words - begin, end_word,
+                          &token->data, &n_matched) &&
+        n_matched && CHAR_BEGINS(text, n_words, begin + n_matched)) {
+        token->n_words = n_matched;
+        token->found = true;
+    } else {
+        token->n_words = n_char_words;
+        token->data = 0;
+        token->found = false;
+    }
+    return token->n_words == n_char_words;
+}
+
+// The token ending at @end by backward maximum matching, walking this trie
+// of reversed keys from @end back: the longest key which begins with a
+// character there, or else one character. Return whether it is a single
+// character.
+bool _Trie::backward_token(const Word text[], Index n_words, Index end,
+                           Word end_word, Token *token) const
 {
+    Index last = end - 1;
+    while (last > 0 && !CHAR_BEGINS(text, n_words, last)) {
+        last--;
+    }
+    token->begin = last;
+    token->data = 0;
+    token->found = false;
     Index tn_idx = ROOT;
-    for (Index i = 0; i < n_words; i++) {
+    Index i = end; // text from i to end is read
+    for (;;) {
         Index base = nodes[tn_idx].base;
-        if (base >= BASE) {
-            Index next = NEXT_INDEX(base, words[i]);
-            if (EXPECT(next >= n_alloced_nodes, 0) || nodes[next].prev != tn_idx) {
-                return;
-            }
-            tn_idx = next;
-        } else {
-            assert(base <= 0);
+        if (base <= 0) {
             assert(-base < n_alloced_tails);
 
+            // The only key left, if text before i ends with its tail.
             struct _Tail *tail = tails - base;
-            Index j = 0;
-
-            while (j < tail->n_words && i < n_words) {
-                if (tail->words[j] != words[i]) {
-                    break;
+            Index n = tail->n_words - 1;
+            if (n >= 0 && n <= i && i - n < end &&
+                TAIL_WORDS(tail)[n] == end_word &&
+                CHAR_BEGINS(text, n_words, i - n)) {
+                Index j = 0;
+                while (j < n && TAIL_WORDS(tail)[j] == text[i - 1 - j]) {
+                    j++;
                 }
-                j++;
-                i++;
-            }
-            if (i < n_words) {
-                return;
-            }
-
-            Tail result;
-            result.n_words = tail->n_words - j;
-            if (result.n_words) {
-                result.words = (Word *)malloc(result.n_words * sizeof *result.words);
-                if (!result.words) {
-                    throw bad_alloc();
+                if (j == n) {
+                    token->begin = i - n;
+                    token->data = tail->data;
+                    token->found = true;
                 }
-                memcpy(result.words, tail->words + j,
-                       result.n_words * sizeof *result.words);
-            } else {
-                result.words = NULL;
             }
-            result.data = tail->data;
-            results.push_back(result);
-            return;
+            break;
         }
-    }
-
-    Index base = nodes[tn_idx].base;
-    if (base <= 0) {
-        assert(-base < n_alloced_tails);
-
-        struct _Tail *tail = tails - base;
-        Tail result;
-        result.n_words = tail->n_words;
-        if (result.n_words) {
-            result.words = (Word *)malloc(result.n_words * sizeof *result.words);
-            if (!result.words) {
-                throw bad_alloc();
+        if (i < end && CHAR_BEGINS(text, n_words, i)) {
+            Index next = NEXT_INDEX(base, end_word);
+            if (EXPECT(next < n_alloced_nodes, 1) &&
+                nodes[next].prev == tn_idx && nodes[next].base <= 0 &&
+                !tails[-nodes[next].base].n_words) {
+                token->begin = i;
+                token->data = tails[-nodes[next].base].data;
+                token->found = true;
             }
-            memcpy(result.words, tail->words, result.n_words * sizeof *result.words);
-        } else {
-            result.words = NULL;
         }
-        result.data = tail->data;
-        results.push_back(result);
-        return;
+        if (!i) {
+            break;
+        }
+        Index next = NEXT_INDEX(base, text[i - 1]);
+        if (EXPECT(next >= n_alloced_nodes, 0) || nodes[next].prev != tn_idx) {
+            break;
+        }
+        tn_idx = next;
+        i--;
     }
+    token->n_words = end - token->begin;
+    return token->begin == last;
+}
 
-    assert(base >= BASE);
-
-    Tail result;
-    Index n_alloced_words = PRE_ALLOCED_WORDS;
-    result.words = (Word *)malloc(n_alloced_words * sizeof *result.words);
-    if (!result.words) {
-        throw bad_alloc();
+// Cut by forward maximum matching, and keep the first @max_tokens tokens.
+// Tokens are not written if @tokens is NULL.
+Index _Trie::forward_match(const Word text[], Index n_words, Word end_word,
+                           Token tokens[], Index max_tokens) const
+{
+    Index n_tokens = 0;
+    for (Index begin = 0; begin < n_words; n_tokens++) {
+        Token token;
+        forward_token(text, n_words, begin, end_word, &token);
+        if (tokens && n_tokens < max_tokens) {
+            tokens[n_tokens] = token;
+        }
+        begin += token.n_words;
     }
-    result.n_words = 0;
-    result.data = 0;
-    collect_all_subs(tn_idx, &result, n_alloced_words, results);
-    free(result.words);
+    return n_tokens;
 }
 
-void _Trie::collect_all_subs(Index tn_idx, struct Tail *result,
-                             Index n_alloced_words, vector<Tail>& results) const
+// Cut by backward maximum matching with @backward, the reversed keys, and
+// keep the first @max_tokens tokens. They come last, so tokens are written
+// around @tokens from its end, and put in order at last.
+Index _Trie::backward_match(const _Trie *backward, const Word text[],
+                            Index n_words, Word end_word, Token tokens[],
+                            Index max_tokens) const
 {
-    vector<Word> subs;
-    collect_sub_nodes(tn_idx, subs);
-    Index subs_size = (Index)subs.size();
-    if (!subs_size) {
-        return;
+    Index n_tokens = 0;
+    for (Index end = n_words; end > 0; n_tokens++) {
+        Token token;
+        backward->backward_token(text, n_words, end, end_word, &token);
+        if (tokens && max_tokens) {
+            tokens[max_tokens - 1 - n_tokens % max_tokens] = token;
+        }
+        end = token.begin;
+    }
+    if (!tokens || !max_tokens) {
+        return n_tokens;
+    }
+    if (n_tokens < max_tokens) {
+        memmove(tokens, tokens + max_tokens - n_tokens,
+                n_tokens * sizeof *tokens);
+    } else {
+        rotate(tokens, tokens + max_tokens - 1 - (n_tokens - 1) % max_tokens,
+               tokens + max_tokens);
     }
+    return n_tokens;
+}
 
-    Index next_word_idx = result->n_words;
+Index _Trie::segment(const Word text[], Index n_words, Word end_word,
+                     SegmentMode mode, Token tokens[], Index max_tokens) const
+{
+    if (mode == FORWARD_MAX_MATCH) {
+        return forward_match(text, n_words, end_word, tokens, max_tokens);
+    }
+    const _Trie *backward = reversed_trie(end_word);
+    if (mode == BACKWARD_MAX_MATCH) {
+        return backward_match(backward, text, n_words, end_word, tokens,
+                              max_tokens);
+    }
 
-    if (EXPECT(next_word_idx >= n_alloced_words, 0)) {
-        Word *old_words = result->words;
-        assert(n_alloced_words);
-        n_alloced_words = n_alloced_words << 1;
-        result->words = (Word *)realloc(result->words,
-                                       n_alloced_words * sizeof *result->words);
-        if (!result->words) {
-            free(old_words);
-            throw bad_alloc();
+    // Both ways are walked in one pass. Forward tokens are written from the
+    // beginning of @tokens and backward ones from its end, while there is
+    // room for both. The way picked is walked again only if its tokens did
+    // not fit in.
+    Index n_forward = 0, n_forward_singles = 0, n_forward_kept = 0;
+    Index n_backward = 0, n_backward_singles = 0, n_backward_kept = 0;
+    Index begin = 0, end = n_words;
+    while (begin < n_words || end > 0) {
+        Token token;
+        if (begin < n_words) {
+            n_forward_singles += forward_token(text, n_words, begin, end_word,
+                                               &token);
+            if (tokens && n_forward_kept == n_forward &&
+                n_forward_kept + n_backward_kept < max_tokens) {
+                tokens[n_forward_kept++] = token;
+            }
+            n_forward++;
+            begin += token.n_words;
+        }
+        if (end > 0) {
+            n_backward_singles += backward->backward_token(text, n_words, end,
+                                                           end_word, &token);
+            if (tokens && n_backward_kept == n_backward &&
+                n_forward_kept + n_backward_kept < max_tokens) {
+                tokens[max_tokens - 1 - n_backward_kept++] = token;
+            }
+            n_backward++;
+            end = token.begin;
+        }
+    }
+    if (n_forward < n_backward ||
+        (n_forward == n_backward && n_forward_singles < n_backward_singles)) {
+        if (tokens && n_forward_kept < min(n_forward, max_tokens)) {
+            forward_match(text, n_words, end_word, tokens, max_tokens);
         }
+        return n_forward;
+    }
+    if (!tokens) {
+        return n_backward;
     }
+    if (n_backward_kept == n_backward) {
+        memmove(tokens, tokens + max_tokens - n_backward,
+                n_backward * sizeof *tokens);
+    } else if (max_tokens) {
+        backward_match(backward, text, n_words, end_word, tokens, max_tokens);
+    }
+    return n_backward;
+}
 
-    for (Index i = 0; i < subs_size; i++) {
-        Index next = NEXT_INDEX(nodes[tn_idx].base, subs[i]);
+void _Trie::drop_links(void)
+{
+    if (links) {
+        free(links->links);
+        free(links->tail_states);
+        free(links->state_tails);
+        delete links;
+        links = NULL;
+    }
+}
+
+// The state after @state reads @word, 0 for none.
+Index _Trie::next_state(Index state, Word word) const
+{
+    if (state < n_alloced_nodes) {
+        Index base = nodes[state].base;
+        if (base >= BASE) {
+            Index next = NEXT_INDEX(base, word);
+            if (EXPECT(next >= n_alloced_nodes, 0) || nodes[next].prev != state) {
+                return 0;
+            }
+            return next;
+        }
+        struct _Tail *tail = tails - base;
+        return tail->n_words && TAIL_WORDS(tail)[0] == word
+               ? links->tail_states[-base] : 0;
+    }
+    Index tail_idx = links->state_tails[state - n_alloced_nodes];
+    struct _Tail *tail = tails + tail_idx;
+    Index j = state - links->tail_states[tail_idx] + 1; // words read
+    return j < tail->n_words && TAIL_WORDS(tail)[j] == word ? state + 1 : 0;
+}
+
+// Whether a key ends at @state, that is, end_word leads to its end.
+bool _Trie::match_state(Index state, Data *data) const
+{
+    Word end_word = links->end_word;
+    struct _Tail *tail;
+    Index j; // words of tail read
+    if (state < n_alloced_nodes) {
+        Index base = nodes[state].base;
+        if (base >= BASE) {
+            Index end = NEXT_INDEX(base, end_word);
+            if (EXPECT(end >= n_alloced_nodes, 0) || nodes[end].prev != state ||
+                nodes[end].base > 0) {
+                return false;
+            }
+            tail = tails - nodes[end].base;
+            if (tail->n_words) {
+                return false;
+            }
+            *data = tail->data;
+            return true;
+        }
+        tail = tails - base;
+        j = 0;
+    } else {
+        Index tail_idx = links->state_tails[state - n_alloced_nodes];
+        tail = tails + tail_idx;
+        j = state - links->tail_states[tail_idx] + 1;
+    }
+    if (j != tail->n_words - 1 || TAIL_WORDS(tail)[j] != end_word) {
+        return false;
+    }
+    *data = tail->data;
+    return true;
+}
+
+// Failure links are found breadth first, as usual, from the goto function
+// of the double array and tails.
+void _Trie::build_links(Word end_word)
+{
+    drop_links();
+
+    struct _Links *new_links = new _Links;
+    new_links->end_word = end_word;
+    new_links->tail_states = (Index *)malloc(n_alloced_tails *
+                                             sizeof *new_links->tail_states);
+    Index n_states = n_alloced_nodes;
+    for (Index i = 0; new_links->tail_states && i < n_alloced_tails; i++) {
+        new_links->tail_states[i] = n_states;
+        if (tails[i].used_by) {
+            n_states += tails[i].n_words;
+        }
+    }
+    new_links->n_states = n_states;
+    new_links->links = (struct _Link *)calloc(n_states, sizeof *new_links->links);
+    new_links->state_tails = (Index *)malloc(
+            (n_states - n_alloced_nodes) * sizeof *new_links->state_tails + 1);
+    if (!new_links->tail_states || !new_links->links ||
+        !new_links->state_tails) {
+        free(new_links->tail_states);
+        free(new_links->links);
+        free(new_links->state_tails);
+        delete new_links;
+        throw bad_alloc();
+    }
+    for (Index i = 0; i < n_alloced_tails; i++) {
+        if (tails[i].used_by) {
+            for (Index j = 0; j < tails[i].n_words; j++) {
+                new_links->state_tails[new_links->tail_states[i] + j -
+                                       n_alloced_nodes] = i;
+            }
+        }
+    }
+    links = new_links;
+
+    struct _Link *link = links->links;
+    link[ROOT].fail = ROOT;
+    vector<Index> queue;
+    queue.push_back(ROOT);
+    for (size_t q = 0; q < queue.size(); q++) {
+        Index state = queue[q];
+        // Sub states of state, and the words leading to them.
+        Index subs[(Word)(~0ULL) + 1];
+        Word words[(Word)(~0ULL) + 1];
+        Index n_subs = 0;
+        if (state < n_alloced_nodes && nodes[state].base >= BASE) {
+            Index base = nodes[state].base;
+            for (Index next = first_sub_node(state); next;
+                 next = next_sub_node(state, next)) {
+                subs[n_subs] = next;
+                words[n_subs++] = WORD_OF(next - base);
+            }
+        } else {
+            struct _Tail *tail;
+            Index j;
+            if (state < n_alloced_nodes) {
+                tail = tails - nodes[state].base;
+                j = 0;
+            } else {
+                Index tail_idx = links->state_tails[state - n_alloced_nodes];
+                tail = tails + tail_idx;
+                j = state - links->tail_states[tail_idx] + 1;
+            }
+            if (j < tail->n_words) {
+                subs[n_subs] = next_state(state, TAIL_WORDS(tail)[j]);
+                words[n_subs++] = TAIL_WORDS(tail)[j];
+            }
+        }
+
+        for (Index i = 0; i < n_subs; i++) {
+            Index sub = subs[i];
+            Index fail = ROOT;
+            if (state != ROOT) {
+                Index from = link[state].fail;
+                Index next;
+                while (!(next = next_state(from, words[i])) && from != ROOT) {
+                    from = link[from].fail;
+                }
+                if (next) {
+                    fail = next;
+                }
+            }
+            Data data;
+            link[sub].fail = fail;
+            link[sub].output = match_state(sub, &data) ? sub
+                                                       : link[fail].output;
+            link[sub].depth = link[state].depth + 1;
+            queue.push_back(sub);
+        }
+    }
+}
+
+bool _Trie::scan(const Word text[], Index n_words, ScanCallback callback,
+                 void *arg, ScanState *state) const
+{
+    if (!links) {
+        throw logic_error(NO_LINKS_VIOLATION);
+    }
+
+    const struct _Link *link = links->links;
+    Index current = state && state->state ? state->state : ROOT;
+    long long n_scanned = state ? state->n_words : 0;
+    bool done = true;
+    for (Index i = 0; done && i < n_words; i++) {
+        Index next;
+        while (!(next = next_state(current, text[i])) && current != ROOT) {
+            current = link[current].fail;
+        }
+        if (next) {
+            current = next;
+        }
+        for (Index match = link[current].output; match;
+             match = link[link[match].fail].output) {
+            Data data;
+            match_state(match, &data);
+            if (!callback(n_scanned + i + 1, link[match].depth, data, arg)) {
+                done = false;
+                n_scanned += i + 1;
+                break;
+            }
+        }
+    }
+    if (state) {
+        state->state = current;
+        state->n_words = done ? n_scanned + n_words : n_scanned;
+    }
+    return done;
+}
+
+void _Trie::drop_ranks(void)
+{
+    free(ranks);
+    ranks = NULL;
+    n_ranked_keys = 0;
+}
+
+// Depth-first in ascending order, counting keys as their tails are met.
+void _Trie::build_ranks(void)
+{
+    drop_ranks();
+
+    Index *new_ranks = (Index *)malloc(n_alloced_nodes * sizeof *ranks);
+    if (!new_ranks) {
+        throw bad_alloc();
+    }
+    Index n_keys = 0;
+    vector<Index> stack(1, (Index)ROOT);
+    vector<Index> subs;
+    while (!stack.empty()) {
+        Index tn_idx = stack.back();
+        stack.pop_back();
+
+        new_ranks[tn_idx] = n_keys;
+        if (nodes[tn_idx].base <= 0) {
+            n_keys++;
+            continue;
+        }
+        subs.clear();
+        for (Index next = first_sub_node(tn_idx); next;
+             next = next_sub_node(tn_idx, next)) {
+            subs.push_back(next);
+        }
+        stack.insert(stack.end(), subs.rbegin(), subs.rend());
+    }
+    ranks = new_ranks;
+    n_ranked_keys = n_keys;
+}
+
+Index _Trie::rank(const Word words[], Index n_words) const
+{
+    if (!ranks) {
+        throw logic_error(NO_RANKS_VIOLATION);
+    }
+
+    struct _Tail *tail;
+    if (!search(words, n_words, &tail)) {
+        return -1;
+    }
+    return ranks[tail->used_by];
+}
+
+// Write the key ending at @tn_idx, which points to a tail, to @words, found
+// by walking up from @tn_idx. Return the number of words in the key.
+Index _Trie::key_of_node(Index tn_idx, Word words[], Index max_words) const
+{
+    Index n_path_words = 0;
+    for (Index i = tn_idx; i != ROOT; i = nodes[i].prev) {
+        n_path_words++;
+    }
+    Index j = n_path_words;
+    for (Index i = tn_idx; i != ROOT; i = nodes[i].prev) {
+        if (--j < max_words) {
+            words[j] = WORD_OF(i - nodes[nodes[i].prev].base);
+        }
+    }
+
+    assert(nodes[tn_idx].base <= 0);
+    assert(-nodes[tn_idx].base < n_alloced_tails);
+
+    struct _Tail *tail = tails - nodes[tn_idx].base;
+    if (n_path_words < max_words && tail->n_words) {
+        Index n = min(tail->n_words, max_words - n_path_words);
+        memcpy(words + n_path_words, TAIL_WORDS(tail), n * sizeof *words);
+    }
+    return n_path_words + tail->n_words;
+}
+
+// Tails keep their index while their keys are in trie, even when nodes are
+// moved, so it is the handle.
+Index _Trie::handle(const Word words[], Index n_words) const
+{
+    struct _Tail *tail;
+    if (!search(words, n_words, &tail)) {
+        return -1;
+    }
+    return (Index)(tail - tails);
+}
+
+Index _Trie::key_of(Index handle, Word words[], Index max_words,
+                    Data *data) const
+{
+    if (handle < 0 || handle >= n_alloced_tails || !tails[handle].used_by) {
+        return -1;
+    }
+    assert(nodes[tails[handle].used_by].base == -handle);
+
+    if (data) {
+        *data = tails[handle].data;
+    }
+    return key_of_node(tails[handle].used_by, words, max_words);
+}
+
+// Go down to the last sub node whose first key is not after @ordinal. Nodes
+// left without sub nodes by erase() have the same number as the next one,
+// so they are never taken.
+Index _Trie::key_at(Index ordinal, Word words[], Index max_words,
+                    Data *data) const
+{
+    if (!ranks) {
+        throw logic_error(NO_RANKS_VIOLATION);
+    }
+    if (ordinal < 0 || ordinal >= n_ranked_keys) {
+        return -1;
+    }
+
+    Index tn_idx = ROOT;
+    while (nodes[tn_idx].base >= BASE) {
+        Index found = 0;
+        for (Index next = first_sub_node(tn_idx);
+             next && ranks[next] <= ordinal;
+             next = next_sub_node(tn_idx, next)) {
+            found = next;
+        }
+        assert(found);
+        tn_idx = found;
+    }
+    if (data) {
+        *data = tails[-nodes[tn_idx].base].data;
+    }
+    return key_of_node(tn_idx, words, max_words);
+}
+
+void _Trie::prefix(const Word words[], Index n_words, vector<Data>& results) const
+{
+    Index tn_idx = ROOT;
+    for (Index i = 0; i < n_words; i++) {
+        Index base = nodes[tn_idx].base;
+        if (base >= BASE) {
+            Index next = NEXT_INDEX(base, words[i]);
+            if (EXPECT(next >= n_alloced_nodes, 0) || nodes[next].prev != tn_idx) {
+                return;
+            }
+            tn_idx = next;
+        } else {
+            assert(base <= 0);
+            assert(-base < n_alloced_tails);
+
+            struct _Tail *tail = tails - base;
+            Index j = 0;
+
+            while (j < tail->n_words && i < n_words) {
+                if (TAIL_WORDS(tail)[j] != words[i]) {
+                    break;
+                }
+                j++;
+                i++;
+            }
+            if (i < n_words) {
+                return;
+            }
+
+            results.push_back(tail->data);
+            return;
+        }
+    }
+
+    Index base = nodes[tn_idx].base;
+    if (base <= 0) {
+        assert(-base < n_alloced_tails);
+
+        struct _Tail *tail = tails - base;
+        results.push_back(tail->data);
+        return;
+    }
+
+    assert(base >= BASE);
+
+    collect_all_subs(tn_idx, results);
+}
+
+void _Trie::collect_all_subs(Index tn_idx, vector<Data>& results) const
+{
+    vector<Word> subs;
+    collect_sub_nodes(tn_idx, subs);
+    Index subs_size = (Index)subs.size();
+    for (Index i = 0; i < subs_size; i++) {
+        Index next = NEXT_INDEX(nodes[tn_idx].base, subs[i]);
         Index base = nodes[next].base;
 
-        result->words[result->n_words++] = subs[i];
-        if (base >= BASE) {
-            collect_all_subs(next, result, n_alloced_words, results);
-        } else {
-            assert(base <= 0);
-            assert(-base < n_alloced_tails);
+        if (base >= BASE) {
+            collect_all_subs(next, results);
+        } else {
+            assert(base <= 0);
+            assert(-base < n_alloced_tails);
+
+            struct _Tail *tail = tails - base;
+            results.push_back(tail->data);
+        }
+    }
+}
+
+void _Trie::prefix(const Word words[], Index n_words, vector<Tail>& results) const
+{
+    Index tn_idx = ROOT;
+    for (Index i = 0; i < n_words; i++) {
+        Index base = nodes[tn_idx].base;
+        if (base >= BASE) {
+            Index next = NEXT_INDEX(base, words[i]);
+            if (EXPECT(next >= n_alloced_nodes, 0) || nodes[next].prev != tn_idx) {
+                return;
+            }
+            tn_idx = next;
+        } else {
+            assert(base <= 0);
+            assert(-base < n_alloced_tails);
+
+            struct _Tail *tail = tails - base;
+            Index j = 0;
+
+            while (j < tail->n_words && i < n_words) {
+                if (TAIL_WORDS(tail)[j] != words[i]) {
+                    break;
+                }
+                j++;
+                i++;
+            }
+            if (i < n_words) {
+                return;
+            }
+
+            Tail result;
+            result.n_words = tail->n_words - j;
+            if (result.n_words) {
+                result.words = (Word *)malloc(result.n_words * sizeof *result.words);
+                if (!result.words) {
+                    throw bad_alloc();
+                }
+                memcpy(result.words, TAIL_WORDS(tail) + j,
+                       result.n_words * sizeof *result.words);
+            } else {
+                result.words = NULL;
+            }
+            result.data = tail->data;
+            results.push_back(result);
+            return;
+        }
+    }
+
+    Index base = nodes[tn_idx].base;
+    if (base <= 0) {
+        assert(-base < n_alloced_tails);
+
+        struct _Tail *tail = tails - base;
+        Tail result;
+        result.n_words = tail->n_words;
+        if (result.n_words) {
+            result.words = (Word *)malloc(result.n_words * sizeof *result.words);
+            if (!result.words) {
+                throw bad_alloc();
+            }
+            memcpy(result.words, TAIL_WORDS(tail), result.n_words * sizeof *result.words);
+        } else {
+            result.words = NULL;
+        }
+        result.data = tail->data;
+        results.push_back(result);
+        return;
+    }
+
+    assert(base >= BASE);
+
+    Tail result;
+    Index n_alloced_words = PRE_ALLOCED_WORDS;
+    result.words = (Word *)malloc(n_alloced_words * sizeof *result.words);
+    if (!result.words) {
+        throw bad_alloc();
+    }
+    result.n_words = 0;
+    result.data = 0;
+    collect_all_subs(tn_idx, &result, n_alloced_words, results);
+    free(result.words);
+}
+
+void _Trie::collect_all_subs(Index tn_idx, struct Tail *result,
+                             Index n_alloced_words, vector<Tail>& results) const
+{
+    vector<Word> subs;
+    collect_sub_nodes(tn_idx, subs);
+    Index subs_size = (Index)subs.size();
+    if (!subs_size) {
+        return;
+    }
+
+    Index next_word_idx = result->n_words;
+
+    if (EXPECT(next_word_idx >= n_alloced_words, 0)) {
+        Word *old_words = result->words;
+        assert(n_alloced_words);
+        n_alloced_words = n_alloced_words << 1;
+        result->words = (Word *)realloc(result->words,
+                                       n_alloced_words * sizeof *result->words);
+        if (!result->words) {
+            free(old_words);
+            throw bad_alloc();
+        }
+    }
+
+    for (Index i = 0; i < subs_size; i++) {
+        Index next = NEXT_INDEX(nodes[tn_idx].base, subs[i]);
+        Index base = nodes[next].base;
+
+        result->words[result->n_words++] = subs[i];
+        if (base >= BASE) {
+            collect_all_subs(next, result, n_alloced_words, results);
+        } else {
+            assert(base <= 0);
+            assert(-base < n_alloced_tails);
+
+            struct _Tail *tail = tails - base;
+            Tail tmp;
+            tmp.n_words = result->n_words + tail->n_words;
+            tmp.words = (Word *)malloc(tmp.n_words * sizeof *tmp.words);
+            if (!tmp.words) {
+                free(result->words);
+                throw bad_alloc();
+            }
+            memcpy(tmp.words, result->words, result->n_words * sizeof *tmp.words);
+            if (tail->n_words) {
+                memcpy(tmp.words + result->n_words, TAIL_WORDS(tail),
+                       tail->n_words * sizeof *tmp.words);
+            }
+            tmp.data = tail->data;
+            results.push_back(tmp);
+        }
+        result->n_words = next_word_idx;
+    }
+}
+
+void _Trie::for_each_prefix(const Word words[], Index n_words,
+                            PrefixCallback callback, void *arg) const
+{
+    struct _PrefixIterator iter;
+    first_prefix(&iter, words, n_words);
+    const Word *key;
+    Index n_key_words;
+    Data data;
+    while (next_prefix(&iter, &key, &n_key_words, &data)) {
+        if (!callback(key, n_key_words, data, arg)) {
+            return;
+        }
+    }
+}
+
+// Row @depth of edit distances between the first @depth words of a key, which
+// ends with @word, and every prefix of @words, computed from row @depth - 1.
+// Return false if no key below can be within @max_edits.
+bool _Trie::next_edit_row(const Word words[], Index n_words, Index max_edits,
+                          Word word, vector<Index>& rows, Index depth) const
+{
+    rows.resize((size_t)(depth + 1) * (n_words + 1));
+    const Index *last = &rows[(size_t)(depth - 1) * (n_words + 1)];
+    Index *row = &rows[(size_t)depth * (n_words + 1)];
+    Index min_edits = row[0] = depth;
+    for (Index j = 1; j <= n_words; j++) {
+        Index edits = last[j - 1] + (words[j - 1] != word);
+        edits = min(edits, last[j] + 1);
+        edits = min(edits, row[j - 1] + 1);
+        row[j] = edits;
+        min_edits = min(min_edits, edits);
+    }
+    return min_edits <= max_edits;
+}
+
+// Depth-first, with one row of Levenshtein distances per depth. A subtree
+// is cut once every distance in its row is above @max_edits.
+void _Trie::fuzzy_search(const Word words[], Index n_words, Index max_edits,
+                         FuzzyCallback callback, void *arg) const
+{
+    if (max_edits < 0) {
+        return;
+    }
+
+    vector<Index> rows(n_words + 1);
+    for (Index j = 0; j <= n_words; j++) {
+        rows[j] = j;
+    }
+    vector<Word> key;
+    // (node, depth)
+    vector<pair<Index, Index> > stack(1, make_pair((Index)ROOT, (Index)0));
+    vector<Index> subs;
+    while (!stack.empty()) {
+        Index idx = stack.back().first;
+        Index depth = stack.back().second;
+        stack.pop_back();
+
+        key.resize(depth ? depth - 1 : 0);
+        if (depth) {
+            Index prev = nodes[idx].prev;
+            Word word = WORD_OF(idx - nodes[prev].base);
+            key.push_back(word);
+            if (!next_edit_row(words, n_words, max_edits, word, rows, depth)) {
+                continue;
+            }
+        }
+
+        Index base = nodes[idx].base;
+        if (base >= BASE) {
+            // With no edit left, only a word which matches the next word of
+            // some cell can keep that cell in bound, so those are looked up
+            // directly instead of trying every sub node.
+            const Index *row = &rows[(size_t)depth * (n_words + 1)];
+            subs.clear();
+            if (*min_element(row, row + n_words + 1) == max_edits) {
+                for (Index j = 0; j < n_words; j++) {
+                    if (row[j] == max_edits) {
+                        subs.push_back(words[j]);
+                    }
+                }
+                sort(subs.begin(), subs.end());
+                subs.erase(unique(subs.begin(), subs.end()), subs.end());
+                size_t n_subs = 0;
+                for (size_t i = 0; i < subs.size(); i++) {
+                    Index next = NEXT_INDEX(base, (Word)subs[i]);
+                    if (next < n_alloced_nodes && nodes[next].prev == idx) {
+                        subs[n_subs++] = next;
+                    }
+                }
+                subs.resize(n_subs);
+            } else {
+                for (Index next = first_sub_node(idx); next;
+                     next = next_sub_node(idx, next)) {
+                    subs.push_back(next);
+                }
+            }
+            // Pushed in reverse so that keys come in ascending order.
+            for (size_t i = subs.size(); i-- > 0; ) {
+                stack.push_back(make_pair(subs[i], depth + 1));
+            }
+            continue;
+        }
+
+        assert(base <= 0);
+        assert(-base < n_alloced_tails);
+
+        struct _Tail *tail = tails - base;
+        Index j = 0;
+        for (; j < tail->n_words; j++) {
+            if (!next_edit_row(words, n_words, max_edits, TAIL_WORDS(tail)[j],
+                               rows, depth + j + 1)) {
+                break;
+            }
+        }
+        if (j < tail->n_words) {
+            continue;
+        }
+        Index n_edits = rows[(size_t)(depth + j) * (n_words + 1) + n_words];
+        if (n_edits > max_edits) {
+            continue;
+        }
+        key.insert(key.end(), TAIL_WORDS(tail), TAIL_WORDS(tail) + tail->n_words);
+        if (!callback(key.empty() ? NULL : &key[0], (Index)key.size(), n_edits,
+                      tail->data, arg)) {
+            return;
+        }
+    }
+}
+
+// Best-first search by max_data, so only the subtrees which may hold one of
+// the top @k keys are visited.
+void _Trie::top_k(const Word words[], Index n_words, Index k,
+                  PrefixCallback callback, void *arg) const
+{
+    if (k <= 0) {
+        return;
+    }
+
+    vector<Word> key(words, words + n_words);
+    Index tn_idx = ROOT;
+    for (Index i = 0; i < n_words; i++) {
+        Index base = nodes[tn_idx].base;
+        if (base >= BASE) {
+            Index next = NEXT_INDEX(base, words[i]);
+            if (EXPECT(next >= n_alloced_nodes, 0) || nodes[next].prev != tn_idx) {
+                return;
+            }
+            tn_idx = next;
+        } else {
+            assert(base <= 0);
+            assert(-base < n_alloced_tails);
+
+            struct _Tail *tail = tails - base;
+            Index j = 0;
+
+            while (j < tail->n_words && i < n_words) {
+                if (TAIL_WORDS(tail)[j] != words[i]) {
+                    break;
+                }
+                j++;
+                i++;
+            }
+            if (i < n_words) {
+                return;
+            }
+
+            key.insert(key.end(), TAIL_WORDS(tail) + j,
+                       TAIL_WORDS(tail) + tail->n_words);
+            callback(key.empty() ? NULL : &key[0], (Index)key.size(),
+                     tail->data, arg);
+            return;
+        }
+    }
+
+    // (max_data, node)
+    vector<pair<Data, Index> > heap;
+    heap.push_back(make_pair(max_data[tn_idx], tn_idx));
+    while (!heap.empty()) {
+        Index idx = heap.front().second;
+        pop_heap(heap.begin(), heap.end());
+        heap.pop_back();
+
+        Index base = nodes[idx].base;
+        if (base >= BASE) {
+            for (Index next = first_sub_node(idx); next;
+                 next = next_sub_node(idx, next)) {
+                heap.push_back(make_pair(max_data[next], next));
+                push_heap(heap.begin(), heap.end());
+            }
+            continue;
+        }
+
+        assert(base <= 0);
+        assert(-base < n_alloced_tails);
+
+        // Words from tn_idx to idx, in reverse order.
+        key.resize(n_words);
+        for (Index i = idx; i != tn_idx; i = nodes[i].prev) {
+            key.push_back(WORD_OF(i - nodes[nodes[i].prev].base));
+        }
+        reverse(key.begin() + n_words, key.end());
+        struct _Tail *tail = tails - base;
+        key.insert(key.end(), TAIL_WORDS(tail), TAIL_WORDS(tail) + tail->n_words);
+        if (!callback(key.empty() ? NULL : &key[0], (Index)key.size(),
+                      tail->data, arg) || !--k) {
+            return;
+        }
+    }
+}
+
+void _Trie::first_prefix(struct _PrefixIterator *iter,
+                         const Word words[], Index n_words) const
+{
+    iter->trie = this;
+    iter->path.clear();
+    iter->key.assign(words, words + n_words);
+    iter->n_path_words = n_words;
+    iter->next_word = 0;
+    iter->pending = false;
+
+    Index tn_idx = ROOT;
+    for (Index i = 0; i < n_words; i++) {
+        Index base = nodes[tn_idx].base;
+        if (base >= BASE) {
+            Index next = NEXT_INDEX(base, words[i]);
+            if (EXPECT(next >= n_alloced_nodes, 0) || nodes[next].prev != tn_idx) {
+                return;
+            }
+            tn_idx = next;
+        } else {
+            assert(base <= 0);
+            assert(-base < n_alloced_tails);
+
+            struct _Tail *tail = tails - base;
+            Index j = 0;
+
+            while (j < tail->n_words && i < n_words) {
+                if (TAIL_WORDS(tail)[j] != words[i]) {
+                    break;
+                }
+                j++;
+                i++;
+            }
+            if (i < n_words) {
+                return;
+            }
+
+            iter->key.insert(iter->key.end(), TAIL_WORDS(tail) + j,
+                             TAIL_WORDS(tail) + tail->n_words);
+            iter->pending = true;
+            iter->data = tail->data;
+            return;
+        }
+    }
+
+    Index base = nodes[tn_idx].base;
+    if (base <= 0) {
+        assert(-base < n_alloced_tails);
+
+        struct _Tail *tail = tails - base;
+        iter->key.insert(iter->key.end(), TAIL_WORDS(tail),
+                         TAIL_WORDS(tail) + tail->n_words);
+        iter->pending = true;
+        iter->data = tail->data;
+        return;
+    }
+
+    assert(base >= BASE);
+
+    iter->path.push_back(tn_idx);
+}
+
+bool _Trie::next_prefix(struct _PrefixIterator *iter, const Word **words,
+                        Index *n_words, Data *data) const
+{
+    vector<Word>& key = iter->key;
+    if (iter->pending) {
+        // The prefix ends in a tail.
+        iter->pending = false;
+        *words = key.empty() ? NULL : &key[0];
+        *n_words = (Index)key.size();
+        *data = iter->data;
+        return true;
+    }
+
+    // Drop the tail of the last output.
+    key.resize(iter->n_path_words);
+    vector<Index>& path = iter->path;
+    while (!path.empty()) {
+        Index tn_idx = path.back();
+        Index base = nodes[tn_idx].base;
+        Index next;
+        if (iter->next_word) {
+            next = next_sub_node(tn_idx, NEXT_INDEX(base, iter->next_word - 1));
+        } else {
+            next = first_sub_node(tn_idx);
+        }
+        if (!next) {
+            // All sub nodes visited, go back to the parent.
+            path.pop_back();
+            if (!path.empty()) {
+                iter->n_path_words--;
+                iter->next_word = key[iter->n_path_words] + 1;
+                key.pop_back();
+            }
+            continue;
+        }
+
+        key.push_back(WORD_OF(next - base));
+        Index sub_base = nodes[next].base;
+        if (sub_base >= BASE) {
+            path.push_back(next);
+            iter->n_path_words++;
+            iter->next_word = 0;
+            continue;
+        }
+
+        assert(sub_base <= 0);
+        assert(-sub_base < n_alloced_tails);
+
+        struct _Tail *tail = tails - sub_base;
+        iter->next_word = WORD_OF(next - base) + 1;
+        key.insert(key.end(), TAIL_WORDS(tail),
+                   TAIL_WORDS(tail) + tail->n_words);
+        *words = &key[0];
+        *n_words = (Index)key.size();
+        *data = tail->data;
+        return true;
+    }
+    return false;
+}
+
+static bool key_less(const Word a[], Index n_a, const Word b[], Index n_b)
+{
+    return lexicographical_compare(a, a + n_a, b, b + n_b);
+}
+
+// Move @cursor to the first (or last if @back) key under @tn_idx, where key
+// holds the words to @tn_idx.
+void _Trie::cursor_down(struct _Cursor *cursor, Index tn_idx, bool back) const
+{
+    cursor->key.resize(cursor->n_path_words);
+    for (;;) {
+        Index base = nodes[tn_idx].base;
+        if (base <= 0) {
+            assert(-base < n_alloced_tails);
+
+            struct _Tail *tail = tails - base;
+            cursor->leaf = tn_idx;
+            cursor->key.insert(cursor->key.end(), TAIL_WORDS(tail),
+                               TAIL_WORDS(tail) + tail->n_words);
+            cursor->data = tail->data;
+            return;
+        }
+        Index sub = back ? last_sub_node(tn_idx) : first_sub_node(tn_idx);
+        if (!sub) {
+            // Left without sub nodes by erase(), or an empty trie.
+            cursor_over(cursor, tn_idx, back);
+            return;
+        }
+        cursor->key.push_back(WORD_OF(sub - base));
+        cursor->n_path_words++;
+        tn_idx = sub;
+    }
+}
+
+// Move @cursor to the first key after (or the last before if @back) all
+// keys under @tn_idx, climbing up until a node has a sibling that way.
+void _Trie::cursor_over(struct _Cursor *cursor, Index tn_idx, bool back) const
+{
+    cursor->key.resize(cursor->n_path_words);
+    while (tn_idx != ROOT) {
+        Index prev = nodes[tn_idx].prev;
+        Index sibling = back ? prev_sub_node(prev, tn_idx)
+                             : next_sub_node(prev, tn_idx);
+        cursor->key.pop_back();
+        cursor->n_path_words--;
+        if (sibling) {
+            cursor->key.push_back(WORD_OF(sibling - nodes[prev].base));
+            cursor->n_path_words++;
+            cursor_down(cursor, sibling, back);
+            return;
+        }
+        tn_idx = prev;
+    }
+    cursor->leaf = 0;
+}
+
+// Move @cursor to the first key not less than (or greater than if @upper)
+// @words, following @words down as far as it goes.
+void _Trie::seek_cursor(struct _Cursor *cursor, const Word words[],
+                        Index n_words, bool upper) const
+{
+    cursor->key.clear();
+    cursor->n_path_words = 0;
+    Index tn_idx = ROOT;
+    for (Index i = 0; ; i++) {
+        Index base = nodes[tn_idx].base;
+        if (base <= 0) {
+            assert(-base < n_alloced_tails);
+
+            struct _Tail *tail = tails - base;
+            const Word *suffix = TAIL_WORDS(tail);
+            if (key_less(suffix, tail->n_words, words + i, n_words - i) ||
+                (upper && !key_less(words + i, n_words - i,
+                                    suffix, tail->n_words))) {
+                cursor_over(cursor, tn_idx, false);
+            } else {
+                cursor_down(cursor, tn_idx, false);
+            }
+            return;
+        }
+        if (i == n_words) {
+            // All keys below are longer.
+            cursor_down(cursor, tn_idx, false);
+            return;
+        }
+        Index next = NEXT_INDEX(base, words[i]);
+        if (next < n_alloced_nodes && nodes[next].prev == tn_idx) {
+            cursor->key.push_back(words[i]);
+            cursor->n_path_words++;
+            tn_idx = next;
+            continue;
+        }
+        // Every key below the first sub node with a greater word is greater.
+        Index sub = first_sub_node(tn_idx);
+        while (sub && WORD_OF(sub - base) < words[i]) {
+            sub = next_sub_node(tn_idx, sub);
+        }
+        if (sub) {
+            cursor->key.push_back(WORD_OF(sub - base));
+            cursor->n_path_words++;
+            cursor_down(cursor, sub, false);
+        } else {
+            cursor_over(cursor, tn_idx, false);
+        }
+        return;
+    }
+}
+
+// Move @cursor to the end if it is out of its range.
+bool _Trie::limit_cursor(struct _Cursor *cursor) const
+{
+    if (cursor->leaf) {
+        const Word *key = &cursor->key[0];
+        Index n_key_words = (Index)cursor->key.size();
+        if (key_less(key, n_key_words, WORDS_OF(cursor->begin),
+                     (Index)cursor->begin.size()) ||
+            (cursor->has_end &&
+             !key_less(key, n_key_words, WORDS_OF(cursor->end),
+                       (Index)cursor->end.size()))) {
+            cursor->leaf = 0;
+        }
+    }
+    return cursor->leaf != 0;
+}
+
+bool _Trie::bound_cursor(struct _Cursor *cursor, const Word words[],
+                         Index n_words, bool upper) const
+{
+    if (key_less(words, n_words, WORDS_OF(cursor->begin),
+                 (Index)cursor->begin.size())) {
+        seek_cursor(cursor, WORDS_OF(cursor->begin),
+                    (Index)cursor->begin.size(), false);
+    } else {
+        seek_cursor(cursor, words, n_words, upper);
+    }
+    return limit_cursor(cursor);
+}
+
+bool _Trie::last_cursor(struct _Cursor *cursor) const
+{
+    cursor->key.clear();
+    cursor->n_path_words = 0;
+    if (cursor->has_end) {
+        seek_cursor(cursor, WORDS_OF(cursor->end), (Index)cursor->end.size(),
+                    false);
+        if (cursor->leaf) {
+            cursor_over(cursor, cursor->leaf, true);
+            return limit_cursor(cursor);
+        }
+    }
+    cursor->key.clear();
+    cursor->n_path_words = 0;
+    cursor_down(cursor, ROOT, true);
+    return limit_cursor(cursor);
+}
+
+bool _Trie::next_cursor(struct _Cursor *cursor) const
+{
+    if (!cursor->leaf) {
+        return false;
+    }
+    cursor_over(cursor, cursor->leaf, false);
+    return limit_cursor(cursor);
+}
+
+bool _Trie::prev_cursor(struct _Cursor *cursor) const
+{
+    if (!cursor->leaf) {
+        return last_cursor(cursor);
+    }
+    cursor_over(cursor, cursor->leaf, true);
+    return limit_cursor(cursor);
+}
+
+// Build the whole double array breadth-first. Every node is given a base
+// only once, when all its sub nodes are known, so nothing is ever moved.
+void _Trie::build(const Word *const keys[], const Index n_words[],
+                  const Data data[], Index n_keys)
+{
+    if (image || view) {
+        throw logic_error(READ_ONLY_VIOLATION);
+    }
+    for (Index k = 0; k < n_keys; k++) {
+        if (n_words[k] <= 0) {
+            throw invalid_argument(INVARIANT_VIOLATION);
+        }
+        if (k) {
+            Index n = n_words[k - 1] < n_words[k] ? n_words[k - 1] : n_words[k];
+            int cmp = memcmp(keys[k - 1], keys[k], n * sizeof **keys);
+            if (cmp > 0) {
+                throw invalid_argument(UNSORTED_VIOLATION);
+            }
+            if (!cmp) {
+                // One is prefix of the other.
+                throw invalid_argument(INVARIANT_VIOLATION);
+            }
+        }
+    }
+
+    release();
+    init();
+    if (n_keys > n_alloced_tails) {
+        struct _Tail *new_tails = (struct _Tail *)alloc_array(n_keys *
+                                                              sizeof *tails);
+        if (!new_tails) {
+            throw bad_alloc();
+        }
+        free_array(tails);
+        tails = new_tails;
+        n_alloced_tails = n_keys;
+    }
+
+    struct Range {
+        Index tn_idx;
+        Index begin;
+        Index end;
+        Index depth;
+    };
+    vector<Range> ranges;
+    Index n_tails = 0;
+
+    Range root = { ROOT, 0, n_keys, 0 };
+    ranges.push_back(root);
+    for (size_t r = 0; r < ranges.size(); r++) {
+        Range range = ranges[r];
+        Word labels[(Word)(~0ULL) + 1];
+        Index begins[(Word)(~0ULL) + 2];
+        Index n_labels = 0;
+        for (Index k = range.begin; k < range.end; k++) {
+            Word word = keys[k][range.depth];
+            if (!n_labels || labels[n_labels - 1] != word) {
+                labels[n_labels] = word;
+                begins[n_labels++] = k;
+            }
+        }
+        begins[n_labels] = range.end;
+        if (!n_labels) {
+            continue;
+        }
+
+        Index base = range.tn_idx == ROOT ? BASE : find_base(labels, n_labels);
+        Index last = base;
+        for (Index i = 0; i < n_labels; i++) {
+            if (NEXT_INDEX(base, labels[i]) > last) {
+                last = NEXT_INDEX(base, labels[i]);
+            }
+        }
+        if (last >= n_alloced_nodes) {
+            expand_nodes(last);
+        }
+
+        nodes[range.tn_idx].base = base;
+        if (family) {
+            family[range.tn_idx].child = labels[0] + 1;
+        }
+        for (Index i = 0; i < n_labels; i++) {
+            Index next = NEXT_INDEX(base, labels[i]);
+            use_node(next);
+            nodes[next].prev = range.tn_idx;
+            if (family) {
+                family[next].child = 0;
+                family[next].sibling = i + 1 < n_labels ? labels[i + 1] + 1 : 0;
+            }
+
+            Index k = begins[i];
+            if (begins[i + 1] - k == 1) {
+                Index depth = range.depth + 1;
+                fill_tail(n_tails, keys[k] + depth, n_words[k] - depth,
+                          data[k], next);
+                nodes[next].base = -n_tails++;
+            } else {
+                Range sub = { next, k, begins[i + 1], range.depth + 1 };
+                ranges.push_back(sub);
+            }
+        }
+    }
+
+    // Give back the cells expand_nodes() allocated in advance.
+    shrink_nodes();
+    init_max_data();
+    next_unused_tail_idx = n_tails;
+}
+
+double _Trie::density(void) const
+{
+    return (double)n_used_nodes / n_alloced_nodes;
+}
+
+MemoryUsage _Trie::memory_usage(void) const
+{
+    MemoryUsage usage;
+    memset(&usage, 0, sizeof usage);
+    usage.n_nodes = n_alloced_nodes;
+    usage.n_used_nodes = n_used_nodes;
+    usage.n_tails = n_alloced_tails;
+    usage.n_used_tails = n_used_tails;
+    usage.n_tail_words = n_alloced_tail_words;
+    usage.n_used_tail_words = n_used_tail_words;
+    usage.n_garbage_tail_words = n_garbage_tail_words;
+    usage.n_shared_tail_words = n_shared_tail_words;
+
+    long long cell_bytes = sizeof *nodes + sizeof *max_data;
+    if (family) {
+        cell_bytes += sizeof *family;
+    }
+    usage.node_bytes = (long long)n_alloced_nodes * cell_bytes;
+    if (blocks) {
+        usage.block_bytes = (long long)(n_alloced_nodes / BLOCK_SIZE) *
+                            sizeof *blocks;
+    }
+    usage.tail_bytes = (long long)n_alloced_tails * sizeof *tails;
+    usage.tail_word_bytes = (long long)n_alloced_tail_words *
+                            sizeof *tail_words;
+    if (links) {
+        usage.index_bytes += (long long)links->n_states * sizeof *links->links +
+                             (long long)n_alloced_tails *
+                             sizeof *links->tail_states +
+                             (long long)(links->n_states - n_alloced_nodes) *
+                             sizeof *links->state_tails;
+    }
+    if (ranks) {
+        usage.index_bytes += (long long)n_alloced_nodes * sizeof *ranks;
+    }
+    for (struct _Reversed *r = reversed; r; r = r->next) {
+        usage.index_bytes += r->trie->memory_usage().total_bytes;
+    }
+    // Root and cell 0 are not free, but not unused either.
+    usage.unused_bytes =
+            (long long)(n_alloced_nodes - n_used_nodes - 2) * cell_bytes +
+            (long long)(n_alloced_tails - n_used_tails) * sizeof *tails +
+            (long long)(n_alloced_tail_words - n_used_tail_words +
+                        n_garbage_tail_words) * sizeof *tail_words;
+    usage.total_bytes = usage.node_bytes + usage.block_bytes +
+                        usage.tail_bytes + usage.tail_word_bytes +
+                        usage.index_bytes;
+    usage.density = (double)n_used_nodes / n_alloced_nodes;
+    if (n_used_tails) {
+        usage.average_tail_words = (double)n_live_tail_words() / n_used_tails;
+    }
+    usage.mapped = image || cow;
+    return usage;
+}
+
+TrieStats _Trie::stats(void) const
+{
+#ifdef TRIE_STATS
+    return counters;
+#else
+    TrieStats zeros;
+    memset(&zeros, 0, sizeof zeros);
+    return zeros;
+#endif
+}
+
+bool _Trie::save(const char *path) const
+{
+    struct _ImageHeader header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, IMAGE_MAGIC, sizeof header.magic);
+    header.version = IMAGE_VERSION;
+    header.index_size = sizeof (Index);
+    header.node_size = sizeof *nodes;
+    header.tail_size = sizeof *tails;
+    header.family_size = family ? sizeof *family : 0;
+    header.codes = codes_checksum();
+    header.n_nodes = n_alloced_nodes;
+    header.n_tails = n_alloced_tails;
+    // Without garbage, tail_words is written as it is, which keeps the words
+    // shared by compact() shared in the image.
+    bool packed = !n_garbage_tail_words;
+    header.n_words = packed ? n_used_tail_words : 0;
+    for (Index i = 0; !packed && i < n_alloced_tails; i++) {
+        if (tails[i].used_by) {
+            header.n_words += tails[i].n_words;
+        }
+    }
+
+    // Write a temporary file and rename() it, so processes which are still
+    // using an old image at @path are never broken.
+    size_t path_len = strlen(path);
+    char *tmp_path = (char *)malloc(path_len + sizeof ".tmp");
+    if (!tmp_path) {
+        throw bad_alloc();
+    }
+    memcpy(tmp_path, path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", sizeof ".tmp");
+    FILE *fp = fopen(tmp_path, "wb");
+    if (!fp) {
+        free(tmp_path);
+        return false;
+    }
+
+    uint64_t sum = 0xcbf29ce484222325ULL;
+    bool ok = fwrite(&header, sizeof header, 1, fp) == 1;
+    if (ok) {
+        size_t size = n_alloced_nodes * sizeof *nodes;
+        sum = checksum(sum, nodes, size);
+        ok = fwrite(nodes, size, 1, fp) == 1;
+    }
+    uint64_t offset = 0;
+    for (Index i = 0; ok && i < n_alloced_tails; i++) {
+        struct _Tail tail = tails[i];
+        if (tail.used_by) {
+            if (!packed) {
+                tail.words = (Index)offset;
+                offset += tail.n_words;
+            }
+        } else {
+            memset(&tail, 0, sizeof tail);
+        }
+        sum = checksum(sum, &tail, sizeof tail);
+        ok = fwrite(&tail, sizeof tail, 1, fp) == 1;
+    }
+    if (ok) {
+        size_t size = n_alloced_nodes * sizeof *max_data;
+        sum = checksum(sum, max_data, size);
+        ok = fwrite(max_data, size, 1, fp) == 1;
+    }
+    if (ok && family) {
+        size_t size = n_alloced_nodes * sizeof *family;
+        sum = checksum(sum, family, size);
+        ok = fwrite(family, size, 1, fp) == 1;
+    }
+    if (ok && packed && n_used_tail_words) {
+        size_t size = n_used_tail_words * sizeof *tail_words;
+        sum = checksum(sum, tail_words, size);
+        ok = fwrite(tail_words, size, 1, fp) == 1;
+    }
+    for (Index i = 0; ok && !packed && i < n_alloced_tails; i++) {
+        if (tails[i].used_by && tails[i].n_words) {
+            size_t size = tails[i].n_words * sizeof *tail_words;
+            sum = checksum(sum, TAIL_WORDS(tails + i), size);
+            ok = fwrite(TAIL_WORDS(tails + i), size, 1, fp) == 1;
+        }
+    }
+    if (ok) {
+        header.checksum = sum;
+        ok = fseek(fp, 0, SEEK_SET) == 0 &&
+             fwrite(&header, sizeof header, 1, fp) == 1;
+    }
+    ok = fclose(fp) == 0 && ok;
+    ok = ok && rename(tmp_path, path) == 0;
+    if (!ok) {
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    return ok;
+}
+
+bool _Trie::open_mapped(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof (struct _ImageHeader)) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+
+    const struct _ImageHeader *header = (const struct _ImageHeader *)addr;
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof header->magic) ||
+        header->version != IMAGE_VERSION ||
+        header->index_size != sizeof (Index) ||
+        header->node_size != sizeof *nodes ||
+        header->tail_size != sizeof *tails ||
+        (header->family_size && header->family_size != sizeof *family) ||
+        header->codes != codes_checksum() ||
+        header->n_nodes <= ROOT || header->n_tails <= 0 ||
+        size != sizeof *header + header->n_nodes * sizeof *nodes +
+                header->n_tails * sizeof *tails +
+                header->n_nodes * sizeof *max_data +
+                header->n_nodes * header->family_size + header->n_words ||
+        header->checksum != checksum(0xcbf29ce484222325ULL, header + 1,
+                                     size - sizeof *header)) {
+        munmap(addr, size);
+        return false;
+    }
+
+    release();
+#ifdef TRIE_STATS
+    // Counts of what was done to the old keys do not tell about the image.
+    memset(&counters, 0, sizeof counters);
+    counters.enabled = true;
+#endif
+    nodes = (struct TrieNode *)(header + 1);
+    n_alloced_nodes = header->n_nodes;
+    tails = (struct _Tail *)(nodes + n_alloced_nodes);
+    n_alloced_tails = header->n_tails;
+    next_unused_tail_idx = n_alloced_tails;
+    max_data = (Data *)(tails + n_alloced_tails);
+    family = NULL;
+#ifdef CHILD_INDEX
+    if (header->family_size) {
+        family = (struct _Family *)(max_data + n_alloced_nodes);
+    }
+#endif
+    blocks = NULL;
+    tail_words = (Word *)((char *)(max_data + n_alloced_nodes) +
+                          n_alloced_nodes * header->family_size);
+    n_alloced_tail_words = header->n_words;
+    n_used_tail_words = n_alloced_tail_words;
+    n_garbage_tail_words = 0;
+    n_shared_tail_words = 0;
+    image = addr;
+    image_size = size;
+    // An image has no free lists to count by, so count once here.
+    n_used_nodes = 0;
+    for (Index i = 0; i < n_alloced_nodes; i++) {
+        if (nodes[i].prev > 0) {
+            n_used_nodes++;
+        }
+    }
+    n_used_tails = 0;
+    for (Index i = 0; i < n_alloced_tails; i++) {
+        if (tails[i].used_by) {
+            n_used_tails++;
+        }
+    }
+    return true;
+}
+
+
+// Copy-on-write storage.
+//
+// The first snapshot() moves all arrays of trie to memfd files (one region
+// per array), which trie maps shared and writable. A snapshot maps the same
+// files read-only, so it costs no copy and shares every page with trie.
+// Before trie writes a page which some snapshots are sharing, the page is
+// copied to the spill file, and those snapshots are remapped to the copy in
+// place. The copy has the same content, so readers of the snapshots never
+// notice. Trie itself keeps one mapping per region and
+// grows it by mremap().
+//
+// Every page a snapshot loses to the spill file becomes a mapping of its own,
+// so a snapshot outliving heavy updates may use many of vm.max_map_count.
+struct _CowRegion {
+    int fd;
+    char *addr;       // where trie maps the region
+    size_t n_pages;
+    Index *n_sharers; // of every page: snapshots mapping it from fd
+};
+
+struct _CowState {
+    pthread_mutex_t lock;
+    Index n_refs;   // by trie and its snapshots
+    bool left;      // trie is gone or has left copy-on-write mode
+    struct _CowRegion regions[N_REGIONS];
+    int spill_fd;
+    size_t n_spill_pages;
+    vector<Index> spill_refs; // of every spill page
+    vector<size_t> free_spill_pages;
+    vector<_Trie *> snapshots;
+};
+
+struct _CowView {
+    char *addr[N_REGIONS];
+    size_t n_pages[N_REGIONS];
+    Index *spill_pages[N_REGIONS]; // -1: the page is still shared with trie
+};
+
+static size_t page_size(void)
+{
+    static size_t size;
+    if (!size) {
+        size = sysconf(_SC_PAGESIZE);
+    }
+    return size;
+}
+
+static size_t n_pages_of(size_t size)
+{
+    size_t n_pages = (size + page_size() - 1) / page_size();
+    // Keep empty arrays mapped too.
+    return n_pages ? n_pages : 1;
+}
+
+static void put_cow_state(struct _CowState *state)
+{
+    // state->lock is held.
+    if (--state->n_refs) {
+        pthread_mutex_unlock(&state->lock);
+        return;
+    }
+    pthread_mutex_unlock(&state->lock);
+    pthread_mutex_destroy(&state->lock);
+    if (state->spill_fd >= 0) {
+        close(state->spill_fd);
+    }
+    delete state;
+}
+
+void *_Trie::get_region(int region, size_t *size) const
+{
+    switch (region) {
+    case NODES_REGION:
+        *size = n_alloced_nodes * sizeof *nodes;
+        return nodes;
+    case TAILS_REGION:
+        *size = n_alloced_tails * sizeof *tails;
+        return tails;
+    case MAX_DATA_REGION:
+        *size = n_alloced_nodes * sizeof *max_data;
+        return max_data;
+    case FAMILY_REGION:
+        *size = family ? n_alloced_nodes * sizeof *family : 0;
+        return family;
+    default:
+        assert(region == TAIL_WORDS_REGION);
+        *size = n_alloced_tail_words * sizeof *tail_words;
+        return tail_words;
+    }
+}
+
+void _Trie::set_region(int region, void *addr)
+{
+    switch (region) {
+    case NODES_REGION:
+        nodes = (struct TrieNode *)addr;
+        break;
+    case TAILS_REGION:
+        tails = (struct _Tail *)addr;
+        break;
+    case MAX_DATA_REGION:
+        max_data = (Data *)addr;
+        break;
+    case FAMILY_REGION:
+#ifdef CHILD_INDEX
+        family = (struct _Family *)addr;
+#endif
+        break;
+    default:
+        assert(region == TAIL_WORDS_REGION);
+        tail_words = (Word *)addr;
+        break;
+    }
+}
+
+// realloc() for nodes, tails and tail_words.
+void *_Trie::resize_region(int region, void *addr, size_t size)
+{
+    if (!cow) {
+        return realloc_array(addr, size);
+    }
+
+    struct _CowRegion *r = cow->regions + region;
+    size_t n_pages = n_pages_of(size);
+    assert(addr == r->addr);
+    if (n_pages < r->n_pages) {
+        // Snapshots must not lose the pages cut off.
+        for (size_t i = n_pages; i < r->n_pages; i++) {
+            if (__atomic_load_n(r->n_sharers + i, __ATOMIC_RELAXED)) {
+                cow_break(region, i);
+            }
+        }
+    } else if (n_pages == r->n_pages) {
+        return addr;
+    }
+
+    pthread_mutex_lock(&cow->lock);
+    Index *n_sharers = (Index *)realloc(r->n_sharers,
+                                        n_pages * sizeof *r->n_sharers);
+    if (!n_sharers) {
+        pthread_mutex_unlock(&cow->lock);
+        return NULL;
+    }
+    r->n_sharers = n_sharers;
+    if (n_pages > r->n_pages) {
+        memset(n_sharers + r->n_pages, 0,
+               (n_pages - r->n_pages) * sizeof *n_sharers);
+        if (ftruncate(r->fd, n_pages * page_size())) {
+            pthread_mutex_unlock(&cow->lock);
+            return NULL;
+        }
+    }
+    void *new_addr = mremap(r->addr, r->n_pages * page_size(),
+                            n_pages * page_size(), MREMAP_MAYMOVE);
+    if (new_addr == MAP_FAILED) {
+        pthread_mutex_unlock(&cow->lock);
+        return NULL;
+    }
+    if (n_pages < r->n_pages) {
+        // It is fine if the file can not be cut.
+        if (ftruncate(r->fd, n_pages * page_size())) {
+        }
+    }
+    r->addr = (char *)new_addr;
+    r->n_pages = n_pages;
+    pthread_mutex_unlock(&cow->lock);
+    return new_addr;
+}
+
+void _Trie::enter_cow(void)
+{
+    struct _CowState *state = new _CowState;
+    pthread_mutex_init(&state->lock, NULL);
+    state->n_refs = 1;
+    state->left = false;
+    state->n_spill_pages = 0;
+    state->spill_fd = memfd_create("trie-spill", MFD_CLOEXEC);
+    Index n_regions = 0;
+    void *heap_addrs[N_REGIONS];
+    if (state->spill_fd >= 0) {
+        for (; n_regions < N_REGIONS; n_regions++) {
+            struct _CowRegion *r = state->regions + n_regions;
+            size_t size;
+            heap_addrs[n_regions] = get_region(n_regions, &size);
+            r->n_pages = n_pages_of(size);
+            r->n_sharers = (Index *)calloc(r->n_pages, sizeof *r->n_sharers);
+            r->fd = memfd_create("trie", MFD_CLOEXEC);
+            r->addr = (char *)MAP_FAILED;
+            if (r->fd >= 0 && !ftruncate(r->fd, r->n_pages * page_size())) {
+                r->addr = (char *)mmap(NULL, r->n_pages * page_size(),
+                                       PROT_READ | PROT_WRITE, MAP_SHARED,
+                                       r->fd, 0);
+            }
+            if (r->addr == MAP_FAILED || !r->n_sharers) {
+                if (r->fd >= 0) {
+                    close(r->fd);
+                }
+                free(r->n_sharers);
+                break;
+            }
+            if (size) {
+                memcpy(r->addr, heap_addrs[n_regions], size);
+            }
+        }
+    }
+    if (n_regions < N_REGIONS) {
+        while (n_regions--) {
+            struct _CowRegion *r = state->regions + n_regions;
+            munmap(r->addr, r->n_pages * page_size());
+            close(r->fd);
+            free(r->n_sharers);
+        }
+        pthread_mutex_lock(&state->lock);
+        put_cow_state(state);
+        throw bad_alloc();
+    }
+
+    for (Index i = 0; i < N_REGIONS; i++) {
+        free_array(heap_addrs[i]);
+        set_region(i, state->regions[i].addr);
+    }
+    cow = state;
+}
+
+void _Trie::leave_cow(void)
+{
+    pthread_mutex_lock(&cow->lock);
+    if (view) {
+        // A snapshot.
+        for (Index i = 0; i < N_REGIONS; i++) {
+            struct _CowRegion *r = cow->regions + i;
+            for (size_t j = 0; j < view->n_pages[i]; j++) {
+                Index spill_page = view->spill_pages[i][j];
+                if (spill_page >= 0) {
+                    if (!--cow->spill_refs[spill_page]) {
+                        // Give the memory back.
+                        fallocate(cow->spill_fd,
+                                  FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                  spill_page * page_size(), page_size());
+                        cow->free_spill_pages.push_back(spill_page);
+                    }
+                } else if (!cow->left) {
+                    assert(j < r->n_pages);
+                    __atomic_sub_fetch(r->n_sharers + j, 1, __ATOMIC_RELAXED);
+                }
+            }
+            munmap(view->addr[i], view->n_pages[i] * page_size());
+            free(view->spill_pages[i]);
+        }
+        for (size_t i = 0; i < cow->snapshots.size(); i++) {
+            if (cow->snapshots[i] == this) {
+                cow->snapshots.erase(cow->snapshots.begin() + i);
+                break;
+            }
+        }
+        delete view;
+        view = NULL;
+    } else {
+        // Snapshots keep the pages they are mapping.
+        for (Index i = 0; i < N_REGIONS; i++) {
+            struct _CowRegion *r = cow->regions + i;
+            munmap(r->addr, r->n_pages * page_size());
+            close(r->fd);
+            free(r->n_sharers);
+        }
+        cow->left = true;
+    }
+    put_cow_state(cow);
+    cow = NULL;
+}
+
+void _Trie::cow_touch(int region, const char *addr, size_t size)
+{
+    assert(!view);
+
+    if (!size) {
+        return;
+    }
+    struct _CowRegion *r = cow->regions + region;
+    size_t first = (addr - r->addr) / page_size();
+    size_t last = (addr + size - 1 - r->addr) / page_size();
+    for (size_t i = first; i <= last; i++) {
+        if (EXPECT(__atomic_load_n(r->n_sharers + i, __ATOMIC_RELAXED), 0)) {
+            cow_break(region, i);
+        }
+    }
+}
+
+// Copy @page of @region to the spill file, and remap the snapshots sharing it.
+void _Trie::cow_break(int region, size_t page)
+{
+    struct _CowRegion *r = cow->regions + region;
+
+    pthread_mutex_lock(&cow->lock);
+    Index n_sharers = r->n_sharers[page];
+    if (!n_sharers) {
+        // Snapshots are gone in the meantime.
+        pthread_mutex_unlock(&cow->lock);
+        return;
+    }
+    size_t spill_page;
+    if (cow->free_spill_pages.empty()) {
+        spill_page = cow->n_spill_pages;
+        if (ftruncate(cow->spill_fd, (spill_page + 1) * page_size())) {
+            pthread_mutex_unlock(&cow->lock);
+            throw bad_alloc();
+        }
+        cow->spill_refs.push_back(0);
+        cow->n_spill_pages++;
+    } else {
+        spill_page = cow->free_spill_pages.back();
+        cow->free_spill_pages.pop_back();
+    }
+    if (pwrite(cow->spill_fd, r->addr + page * page_size(), page_size(),
+               spill_page * page_size()) != (ssize_t)page_size()) {
+        cow->free_spill_pages.push_back(spill_page);
+        pthread_mutex_unlock(&cow->lock);
+        throw bad_alloc();
+    }
+    for (size_t i = 0; i < cow->snapshots.size(); i++) {
+        struct _CowView *v = cow->snapshots[i]->view;
+        if (page < v->n_pages[region] && v->spill_pages[region][page] < 0) {
+            // Replacing a mapping is atomic to readers.
+            if (mmap(v->addr[region] + page * page_size(), page_size(),
+                     PROT_READ, MAP_SHARED | MAP_FIXED, cow->spill_fd,
+                     spill_page * page_size()) == MAP_FAILED) {
+                pthread_mutex_unlock(&cow->lock);
+                throw bad_alloc();
+            }
+            v->spill_pages[region][page] = spill_page;
+            cow->spill_refs[spill_page]++;
+            r->n_sharers[page]--;
+        }
+    }
+    assert(!r->n_sharers[page]);
+    pthread_mutex_unlock(&cow->lock);
+}
+
+// Return a read-only trie sharing all pages with this one. Later changes to
+// this trie copy only the pages they write.
+_Trie *_Trie::snapshot(void)
+{
+    if (image || view) {
+        throw logic_error(READ_ONLY_VIOLATION);
+    }
+    if (!cow) {
+        enter_cow();
+    }
+
+    _Trie *snap = new _Trie;
+    snap->release();
+    snap->nodes = NULL;
+    snap->max_data = NULL;
+    snap->family = NULL;
+    snap->blocks = NULL;
+    snap->tails = NULL;
+    snap->tail_words = NULL;
+    snap->n_alloced_nodes = n_alloced_nodes;
+    snap->n_used_nodes = n_used_nodes;
+    snap->n_alloced_tails = n_alloced_tails;
+    snap->n_used_tails = n_used_tails;
+    snap->next_unused_tail_idx = next_unused_tail_idx;
+    snap->n_alloced_tail_words = n_alloced_tail_words;
+    snap->n_used_tail_words = n_used_tail_words;
+    snap->n_garbage_tail_words = n_garbage_tail_words;
+    snap->n_shared_tail_words = n_shared_tail_words;
+
+    struct _CowView *v = new _CowView;
+    Index i;
+    pthread_mutex_lock(&cow->lock);
+    for (i = 0; i < N_REGIONS; i++) {
+        struct _CowRegion *r = cow->regions + i;
+        v->n_pages[i] = r->n_pages;
+        v->spill_pages[i] = (Index *)malloc(r->n_pages *
+                                            sizeof *v->spill_pages[i]);
+        v->addr[i] = (char *)mmap(NULL, r->n_pages * page_size(), PROT_READ,
+                                  MAP_SHARED, r->fd, 0);
+        if (!v->spill_pages[i] || v->addr[i] == MAP_FAILED) {
+            free(v->spill_pages[i]);
+            if (v->addr[i] != MAP_FAILED) {
+                munmap(v->addr[i], r->n_pages * page_size());
+            }
+            break;
+        }
+    }
+    if (i < N_REGIONS) {
+        while (i--) {
+            munmap(v->addr[i], v->n_pages[i] * page_size());
+            free(v->spill_pages[i]);
+        }
+        pthread_mutex_unlock(&cow->lock);
+        delete v;
+        delete snap;
+        throw bad_alloc();
+    }
+    try {
+        cow->snapshots.push_back(snap);
+    } catch (...) {
+        for (i = 0; i < N_REGIONS; i++) {
+            munmap(v->addr[i], v->n_pages[i] * page_size());
+            free(v->spill_pages[i]);
+        }
+        pthread_mutex_unlock(&cow->lock);
+        delete v;
+        delete snap;
+        throw;
+    }
+    for (i = 0; i < N_REGIONS; i++) {
+        struct _CowRegion *r = cow->regions + i;
+        for (size_t j = 0; j < r->n_pages; j++) {
+            v->spill_pages[i][j] = -1;
+            __atomic_add_fetch(r->n_sharers + j, 1, __ATOMIC_RELAXED);
+        }
+        snap->set_region(i, v->addr[i]);
+    }
+    cow->n_refs++;
+    pthread_mutex_unlock(&cow->lock);
+    snap->cow = cow;
+    snap->view = v;
+
+    // Reversed keys are shared by snapshots as well.
+    try {
+        for (struct _Reversed *r = reversed; r; r = r->next) {
+            struct _Reversed *copy = new _Reversed;
+            copy->end_word = r->end_word;
+            copy->trie = NULL;
+            copy->next = snap->reversed;
+            snap->reversed = copy;
+            copy->trie = r->trie->snapshot();
+        }
+    } catch (...) {
+        delete snap;
+        throw;
+    }
+    return snap;
+}
+
+// Readers of ConcurrentTrie never lock. Each reader thread owns a slot, and
+// writes the epoch in which it starts reading to the slot. A version of trie
+// replaced by publish() is retired with the epoch of its replacement, and is
+// deleted only when no reader is reading in that epoch or before.
+struct _ReaderSlot {
+    uint64_t epoch; // 0 when not reading
+    Index depth;    // nesting level of reading
+    char padding[CACHE_LINE_SIZE - sizeof (uint64_t) - sizeof (Index)];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct _ReaderSlot reader_slots[MAX_READERS];
+static char reader_slot_used[MAX_READERS];
+static uint64_t global_epoch = 1;
+static __thread struct _ReaderSlot *reader_slot;
+static pthread_key_t reader_slot_key;
+static pthread_once_t reader_slot_key_once = PTHREAD_ONCE_INIT;
+
+static void put_reader_slot(void *slot)
+{
+    __atomic_store_n(reader_slot_used + ((struct _ReaderSlot *)slot - reader_slots),
+                     0, __ATOMIC_RELEASE);
+}
+
+static void create_reader_slot_key(void)
+{
+    if (pthread_key_create(&reader_slot_key, put_reader_slot)) {
+        abort();
+    }
+}
+
+static struct _ReaderSlot *get_reader_slot(void)
+{
+    if (EXPECT(reader_slot != NULL, 1)) {
+        return reader_slot;
+    }
+    pthread_once(&reader_slot_key_once, create_reader_slot_key);
+    for (Index i = 0; i < MAX_READERS; i++) {
+        if (!__atomic_exchange_n(reader_slot_used + i, 1, __ATOMIC_ACQUIRE)) {
+            reader_slot = reader_slots + i;
+            pthread_setspecific(reader_slot_key, reader_slot);
+            return reader_slot;
+        }
+    }
+    throw runtime_error("Too many threads reading ConcurrentTrie.");
+}
+
+class _ConcurrentTrie {
+    _Trie *writer;
+    _Trie *published;
+    struct Retired {
+        _Trie *trie;
+        uint64_t epoch;
+    };
+    vector<Retired> retired;
+
+    void reclaim(void);
+
+public:
+    _ConcurrentTrie(void);
+    ~_ConcurrentTrie(void);
+
+    _Trie *writable(void) { return writer; }
+    void publish(void);
+    const _Trie *enter(void) const;
+    void exit(void) const;
+};
+
+_ConcurrentTrie::_ConcurrentTrie(void)
+{
+    writer = new _Trie;
+    try {
+        published = writer->snapshot();
+    } catch (...) {
+        delete writer;
+        throw;
+    }
+}
+
+_ConcurrentTrie::~_ConcurrentTrie(void)
+{
+    delete writer;
+    delete published;
+    for (size_t i = 0; i < retired.size(); i++) {
+        delete retired[i].trie;
+    }
+}
 
-            struct _Tail *tail = tails - base;
-            Tail tmp;
-            tmp.n_words = result->n_words + tail->n_words;
-            tmp.words = (Word *)malloc(tmp.n_words * sizeof *tmp.words);
-            if (!tmp.words) {
-                free(result->words);
-                throw bad_alloc();
-            }
-            memcpy(tmp.words, result->words, result->n_words * sizeof *tmp.words);
-            memcpy(tmp.words + result->n_words, tail->words,
-                   tail->n_words * sizeof *tmp.words);
-            tmp.data = tail->data;
-            results.push_back(tmp);
-        }
-        result->n_words = next_word_idx;
+const _Trie *_ConcurrentTrie::enter(void) const
+{
+    struct _ReaderSlot *slot = get_reader_slot();
+    if (!slot->depth++) {
+        // Sequentially consistent, so publish() can not miss the slot when
+        // we read the version it replaces.
+        __atomic_store_n(&slot->epoch,
+                         __atomic_load_n(&global_epoch, __ATOMIC_RELAXED),
+                         __ATOMIC_SEQ_CST);
+    }
+    return __atomic_load_n(&published, __ATOMIC_SEQ_CST);
+}
+
+void _ConcurrentTrie::exit(void) const
+{
+    struct _ReaderSlot *slot = reader_slot;
+    if (!--slot->depth) {
+        __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+    }
+}
+
+// The published version is a snapshot of the writer's trie, so publishing
+// copies nothing, and later updates copy only the pages they write.
+void _ConcurrentTrie::publish(void)
+{
+    Retired old;
+    old.trie = writer->snapshot();
+    old.trie = __atomic_exchange_n(&published, old.trie, __ATOMIC_SEQ_CST);
+    old.epoch = __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST);
+    try {
+        retired.push_back(old);
+    } catch (...) {
+        // Leak rather than delete a trie readers may be reading.
     }
+    reclaim();
 }
 
+void _ConcurrentTrie::reclaim(void)
+{
+    uint64_t min_epoch = UINT64_MAX;
+    for (Index i = 0; i < MAX_READERS; i++) {
+        uint64_t epoch = __atomic_load_n(&reader_slots[i].epoch,
+                                         __ATOMIC_ACQUIRE);
+        if (epoch && epoch < min_epoch) {
+            min_epoch = epoch;
+        }
+    }
+    size_t n_retired = 0;
+    for (size_t i = 0; i < retired.size(); i++) {
+        if (retired[i].epoch < min_epoch) {
+            delete retired[i].trie;
+        } else {
+            retired[n_retired++] = retired[i];
+        }
+    }
+    retired.resize(n_retired);
+}
 
 
 Trie::Trie(void)
@@ -1106,7 +4802,7 @@ Trie::~Trie(void)
     delete (_Trie *)trie;
 }
 
-void Trie::insert(const Word words[], Index n_words, Index data)
+void Trie::insert(const Word words[], Index n_words, Data data)
 {
     _Trie *native = (_Trie *)trie;
     native->insert(words, n_words, data);
@@ -1119,13 +4815,20 @@ void Trie::erase(const Word words[], Index n_words)
 }
 
 bool Trie::search(const Word words[], Index n_words,
-                  Index *data, Index *unmatch) const
+                  Data *data, Index *unmatch) const
 {
     _Trie *native = (_Trie *)trie;
     return native->search(words, n_words, data, unmatch);
 }
 
-void Trie::prefix(const Word words[], Index n_words, vector<Index>& tails) const
+void Trie::search_batch(const Word *const words[], const Index n_words[],
+                        Index n, Data data[], bool found[]) const
+{
+    _Trie *native = (_Trie *)trie;
+    native->search_batch(words, n_words, n, data, found);
+}
+
+void Trie::prefix(const Word words[], Index n_words, vector<Data>& tails) const
 {
     _Trie *native = (_Trie *)trie;
     native->prefix(words, n_words, tails);
@@ -1137,16 +4840,484 @@ void Trie::prefix(const Word words[], Index n_words, vector<Tail>& tails) const
     native->prefix(words, n_words, tails);
 }
 
+void Trie::top_k(const Word words[], Index n_words, Index k,
+                 PrefixCallback callback, void *arg) const
+{
+    _Trie *native = (_Trie *)trie;
+    native->top_k(words, n_words, k, callback, arg);
+}
+
+void Trie::for_each_prefix(const Word words[], Index n_words,
+                           PrefixCallback callback, void *arg) const
+{
+    _Trie *native = (_Trie *)trie;
+    native->for_each_prefix(words, n_words, callback, arg);
+}
+
+void Trie::fuzzy_search(const Word words[], Index n_words, Index max_edits,
+                        FuzzyCallback callback, void *arg) const
+{
+    _Trie *native = (_Trie *)trie;
+    native->fuzzy_search(words, n_words, max_edits, callback, arg);
+}
+
 bool Trie::segment_max_match(const Word words[], Index n_words, Word end_word,
-                             Index *data, Index *unmatch) const
+                             Data *data, Index *unmatch) const
 {
     _Trie *native = (_Trie *)trie;
     return native->segment_max_match(words, n_words, end_word, data, unmatch);
 }
 
 bool Trie::segment_min_match(const Word words[], Index n_words, Word end_word,
-                             Index *data, Index *unmatch) const
+                             Data *data, Index *unmatch) const
 {
     _Trie *native = (_Trie *)trie;
     return native->segment_min_match(words, n_words, end_word, data, unmatch);
 }
+
+Index Trie::common_prefix_search(const Word words[], Index n_words,
+                                 Word end_word, Match results[],
+                                 Index max_results) const
+{
+    _Trie *native = (_Trie *)trie;
+    return native->common_prefix_search(words, n_words, end_word, results,
+                                         max_results);
+}
+
+Index Trie::segment(const Word text[], Index n_words, Word end_word,
+                    SegmentMode mode, Token tokens[], Index max_tokens) const
+{
+    _Trie *native = (_Trie *)trie;
+    return native->segment(text, n_words, end_word, mode, tokens, max_tokens);
+}
+
+void Trie::build_links(Word end_word)
+{
+    _Trie *native = (_Trie *)trie;
+    native->build_links(end_word);
+}
+
+void Trie::build_reversed(Word end_word)
+{
+    _Trie *native = (_Trie *)trie;
+    native->build_reversed(end_word);
+}
+
+bool Trie::scan(const Word text[], Index n_words, ScanCallback callback,
+                void *arg, ScanState *state) const
+{
+    _Trie *native = (_Trie *)trie;
+    return native->scan(text, n_words, callback, arg, state);
+}
+
+Index Trie::handle(const Word words[], Index n_words) const
+{
+    _Trie *native = (_Trie *)trie;
+    return native->handle(words, n_words);
+}
+
+Index Trie::key_of(Index handle, Word words[], Index max_words,
+                   Data *data) const
+{
+    _Trie *native = (_Trie *)trie;
+    return native->key_of(handle, words, max_words, data);
+}
+
+void Trie::build_ranks(void)
+{
+    _Trie *native = (_Trie *)trie;
+    native->build_ranks();
+}
+
+Index Trie::rank(const Word words[], Index n_words) const
+{
+    _Trie *native = (_Trie *)trie;
+    return native->rank(words, n_words);
+}
+
+Index Trie::key_at(Index ordinal, Word words[], Index max_words,
+                   Data *data) const
+{
+    _Trie *native = (_Trie *)trie;
+    return native->key_at(ordinal, words, max_words, data);
+}
+
+bool Trie::save(const char *path) const
+{
+    _Trie *native = (_Trie *)trie;
+    return native->save(path);
+}
+
+bool Trie::open_mapped(const char *path)
+{
+    _Trie *native = (_Trie *)trie;
+    return native->open_mapped(path);
+}
+
+void Trie::build(const Word *const keys[], const Index n_words[],
+                 const Data data[], Index n_keys)
+{
+    _Trie *native = (_Trie *)trie;
+    native->build(keys, n_words, data, n_keys);
+}
+
+void Trie::compact(void)
+{
+    _Trie *native = (_Trie *)trie;
+    native->compact();
+}
+
+bool Trie::compact_storage(Index max_steps)
+{
+    _Trie *native = (_Trie *)trie;
+    return native->compact_storage(max_steps);
+}
+
+void Trie::reserve(Index n_keys, Index n_words)
+{
+    _Trie *native = (_Trie *)trie;
+    native->reserve(n_keys, n_words);
+}
+
+void Trie::set_growth(double factor, Index chunk)
+{
+    _Trie *native = (_Trie *)trie;
+    native->set_growth(factor, chunk);
+}
+
+double Trie::density(void) const
+{
+    _Trie *native = (_Trie *)trie;
+    return native->density();
+}
+
+TrieStats Trie::stats(void) const
+{
+    _Trie *native = (_Trie *)trie;
+    return native->stats();
+}
+
+MemoryUsage Trie::memory_usage(void) const
+{
+    _Trie *native = (_Trie *)trie;
+    return native->memory_usage();
+}
+
+Trie::Trie(void *trie)
+{
+    this->trie = trie;
+}
+
+Trie *Trie::snapshot(void)
+{
+    _Trie *native = (_Trie *)trie;
+    _Trie *snap = native->snapshot();
+    try {
+        return new Trie(snap);
+    } catch (...) {
+        delete snap;
+        throw;
+    }
+}
+
+
+PrefixIterator::PrefixIterator(const Trie& trie, const Word words[],
+                               Index n_words)
+{
+    _Trie *native = (_Trie *)trie.trie;
+    struct _PrefixIterator *native_iter = new _PrefixIterator;
+    try {
+        native->first_prefix(native_iter, words, n_words);
+    } catch (...) {
+        delete native_iter;
+        throw;
+    }
+    iter = native_iter;
+}
+
+PrefixIterator::~PrefixIterator(void)
+{
+    delete (struct _PrefixIterator *)iter;
+}
+
+bool PrefixIterator::next(const Word **words, Index *n_words, Data *data)
+{
+    struct _PrefixIterator *native_iter = (struct _PrefixIterator *)iter;
+    return native_iter->trie->next_prefix(native_iter, words, n_words, data);
+}
+
+
+Cursor::Cursor(const Trie& trie)
+{
+    struct _Cursor *native_cursor = new _Cursor;
+    native_cursor->trie = (_Trie *)trie.trie;
+    native_cursor->leaf = 0;
+    native_cursor->n_path_words = 0;
+    native_cursor->data = 0;
+    native_cursor->has_end = false;
+    cursor = native_cursor;
+}
+
+Cursor::~Cursor(void)
+{
+    delete (struct _Cursor *)cursor;
+}
+
+bool Cursor::range(const Word begin[], Index n_begin,
+                   const Word end[], Index n_end)
+{
+    struct _Cursor *native_cursor = (struct _Cursor *)cursor;
+    native_cursor->begin.assign(begin, begin + n_begin);
+    native_cursor->has_end = end != NULL;
+    native_cursor->end.assign(end, end + (end ? n_end : 0));
+    return first();
+}
+
+bool Cursor::lower_bound(const Word words[], Index n_words)
+{
+    struct _Cursor *native_cursor = (struct _Cursor *)cursor;
+    return native_cursor->trie->bound_cursor(native_cursor, words, n_words,
+                                             false);
+}
+
+bool Cursor::upper_bound(const Word words[], Index n_words)
+{
+    struct _Cursor *native_cursor = (struct _Cursor *)cursor;
+    return native_cursor->trie->bound_cursor(native_cursor, words, n_words,
+                                             true);
+}
+
+bool Cursor::first(void)
+{
+    struct _Cursor *native_cursor = (struct _Cursor *)cursor;
+    return native_cursor->trie->bound_cursor(
+        native_cursor, WORDS_OF(native_cursor->begin),
+        (Index)native_cursor->begin.size(), false);
+}
+
+bool Cursor::last(void)
+{
+    struct _Cursor *native_cursor = (struct _Cursor *)cursor;
+    return native_cursor->trie->last_cursor(native_cursor);
+}
+
+bool Cursor::next(void)
+{
+    struct _Cursor *native_cursor = (struct _Cursor *)cursor;
+    return native_cursor->trie->next_cursor(native_cursor);
+}
+
+bool Cursor::prev(void)
+{
+    struct _Cursor *native_cursor = (struct _Cursor *)cursor;
+    return native_cursor->trie->prev_cursor(native_cursor);
+}
+
+bool Cursor::get(const Word **words, Index *n_words, Data *data) const
+{
+    struct _Cursor *native_cursor = (struct _Cursor *)cursor;
+    if (!native_cursor->leaf) {
+        return false;
+    }
+    *words = &native_cursor->key[0];
+    *n_words = (Index)native_cursor->key.size();
+    *data = native_cursor->data;
+    return true;
+}
+
+ConcurrentTrie::ConcurrentTrie(void)
+{
+    trie = new _ConcurrentTrie;
+}
+
+ConcurrentTrie::~ConcurrentTrie(void)
+{
+    delete (_ConcurrentTrie *)trie;
+}
+
+void ConcurrentTrie::insert(const Word words[], Index n_words, Data data)
+{
+    _ConcurrentTrie *native = (_ConcurrentTrie *)trie;
+    native->writable()->insert(words, n_words, data);
+}
+
+void ConcurrentTrie::erase(const Word words[], Index n_words)
+{
+    _ConcurrentTrie *native = (_ConcurrentTrie *)trie;
+    native->writable()->erase(words, n_words);
+}
+
+bool ConcurrentTrie::compact_storage(Index max_steps)
+{
+    _ConcurrentTrie *native = (_ConcurrentTrie *)trie;
+    return native->writable()->compact_storage(max_steps);
+}
+
+void ConcurrentTrie::build_reversed(Word end_word)
+{
+    _ConcurrentTrie *native = (_ConcurrentTrie *)trie;
+    native->writable()->build_reversed(end_word);
+}
+
+void ConcurrentTrie::publish(void)
+{
+    _ConcurrentTrie *native = (_ConcurrentTrie *)trie;
+    native->publish();
+}
+
+bool ConcurrentTrie::search(const Word words[], Index n_words,
+                            Data *data, Index *unmatch) const
+{
+    _ConcurrentTrie *native = (_ConcurrentTrie *)trie;
+    bool result = native->enter()->search(words, n_words, data, unmatch);
+    native->exit();
+    return result;
+}
+
+void ConcurrentTrie::search_batch(const Word *const words[],
+                                  const Index n_words[], Index n,
+                                  Data data[], bool found[]) const
+{
+    _ConcurrentTrie *native = (_ConcurrentTrie *)trie;
+    native->enter()->search_batch(words, n_words, n, data, found);
+    native->exit();
+}
+
+void ConcurrentTrie::prefix(const Word words[], Index n_words,
+                            vector<Data>& tails) const
+{
+    _ConcurrentTrie *native = (_ConcurrentTrie *)trie;
+    const _Trie *t = native->enter();
+    try {
+        t->prefix(words, n_words, tails);
+    } catch (...) {
+        native->exit();
+        throw;
+    }
+    native->exit();
+}
+
+void ConcurrentTrie::prefix(const Word words[], Index n_words,
+                            vector<Tail>& tails) const
+{
+    _ConcurrentTrie *native = (_ConcurrentTrie *)trie;
+    const _Trie *t = native->enter();
+    try {
+        t->prefix(words, n_words, tails);
+    } catch (...) {
+        native->exit();
+        throw;
+    }
+    native->exit();
+}
+
+void ConcurrentTrie::top_k(const Word words[], Index n_words, Index k,
+                           PrefixCallback callback, void *arg) const
+{
+    _ConcurrentTrie *native = (_ConcurrentTrie *)trie;
+    const _Trie *t = native->enter();
+    try {
+        t->top_k(words, n_words, k, callback, arg);
+    } catch (...) {
+        native->exit();
+        throw;
+    }
+    native->exit();
+}
+
+void ConcurrentTrie::for_each_prefix(const Word words[], Index n_words,
+                                     PrefixCallback callback, void *arg) const
+{
+    _ConcurrentTrie *native = (_ConcurrentTrie *)trie;
+    const _Trie *t = native->enter();
+    try {
+        t->for_each_prefix(words, n_words, callback, arg);
+    } catch (...) {
+        native->exit();
+        throw;
+    }
+    native->exit();
+}
+
+void ConcurrentTrie::fuzzy_search(const Word words[], Index n_words,
+                                  Index max_edits, FuzzyCallback callback,
+                                  void *arg) const
+{
+    _ConcurrentTrie *native = (_ConcurrentTrie *)trie;
+    const _Trie *t = native->enter();
+    try {
+        t->fuzzy_search(words, n_words, max_edits, callback, arg);
+    } catch (...) {
+        native->exit();
+        throw;
+    }
+    native->exit();
+}
+
+bool ConcurrentTrie::segment_max_match(const Word words[], Index n_words,
+                                       Word end_word, Data *data,
+                                       Index *unmatch) const
+{
+    _ConcurrentTrie *native = (_ConcurrentTrie *)trie;
+    bool result = native->enter()->segment_max_match(words, n_words, end_word,
+                                                     data, unmatch);
+    native->exit();
+    return result;
+}
+
+bool ConcurrentTrie::segment_min_match(const Word words[], Index n_words,
+                                       Word end_word, Data *data,
+                                       Index *unmatch) const
+{
+    _ConcurrentTrie *native = (_ConcurrentTrie *)trie;
+    bool result = native->enter()->segment_min_match(words, n_words, end_word,
+                                                     data, unmatch);
+    native->exit();
+    return result;
+}
+
+Index ConcurrentTrie::common_prefix_search(const Word words[], Index n_words,
+                                           Word end_word, Match results[],
+                                           Index max_results) const
+{
+    _ConcurrentTrie *native = (_ConcurrentTrie *)trie;
+    Index n_results = native->enter()->common_prefix_search(
+        words, n_words, end_word, results, max_results);
+    native->exit();
+    return n_results;
+}
+
+Index ConcurrentTrie::handle(const Word words[], Index n_words) const
+{
+    _ConcurrentTrie *native = (_ConcurrentTrie *)trie;
+    Index result = native->enter()->handle(words, n_words);
+    native->exit();
+    return result;
+}
+
+Index ConcurrentTrie::key_of(Index handle, Word words[], Index max_words,
+                             Data *data) const
+{
+    _ConcurrentTrie *native = (_ConcurrentTrie *)trie;
+    Index n_words = native->enter()->key_of(handle, words, max_words, data);
+    native->exit();
+    return n_words;
+}
+
+Index ConcurrentTrie::segment(const Word text[], Index n_words, Word end_word,
+                              SegmentMode mode, Token tokens[],
+                              Index max_tokens) const
+{
+    _ConcurrentTrie *native = (_ConcurrentTrie *)trie;
+    const _Trie *t = native->enter();
+    Index n_tokens;
+    try {
+        n_tokens = t->segment(text, n_words, end_word, mode, tokens,
+                              max_tokens);
+    } catch (...) {
+        native->exit();
+        throw;
+    }
+    native->exit();
+    return n_tokens;
+}
@@ -3,9 +3,23 @@
 #ifndef _trie_h_
 #define _trie_h_
 
+#include <cstddef>
 #include <vector>
 
+// Index counts nodes, tails and words. Define TRIE_64BIT_INDEX for tries of
+// more than 2^31 nodes or tail words. Data is the value of every key; define
+// TRIE_64BIT_DATA to store bigger values such as file offsets. Both cost
+// memory, and the same definitions must be used by trie.cpp and its users.
+#ifdef TRIE_64BIT_INDEX
+typedef long long Index; // assert((Index)-1 < 0)
+#else
 typedef int Index; // assert((Index)-1 < 0)
+#endif
+#ifdef TRIE_64BIT_DATA
+typedef long long Data;
+#else
+typedef int Data;
+#endif
 // Change Word to other bigger types is not recommended.
 // (Will slow down the algorithm.)
 typedef unsigned char Word; // assert((Word)-1 > 0)
@@ -13,29 +27,324 @@ typedef unsigned char Word; // assert((Word)-1 > 0)
 struct Tail {
     Word *words;
     Index n_words;
-    Index data;
+    Data data;
+};
+
+// A piece of text cut by segment(): @n_words words from @begin, which are a
+// key with @data if @found, or else a single character which begins no key.
+struct Token {
+    Index begin;
+    Index n_words;
+    Data data;
+    bool found;
+};
+
+// A key found by common_prefix_search(): the first @n_words words of the
+// input (end word not included), with @data.
+struct Match {
+    Index n_words;
+    Data data;
+};
+
+// Forward and backward maximum matching cut the longest key from the
+// beginning and from the end of the rest of text. Bidirectional takes the
+// result of them with fewer tokens, and then with fewer single characters,
+// preferring backward.
+enum SegmentMode {
+    FORWARD_MAX_MATCH,
+    BACKWARD_MAX_MATCH,
+    BIDIRECTIONAL_MAX_MATCH
+};
+
+// Where scan() stopped in a stream of text, to go on with the next chunk.
+// It should be zeroed before the first chunk.
+struct ScanState {
+    Index state;
+    long long n_words; // scanned before
+};
+
+// Called with every key found by scan(), which ends before word @end of the
+// stream and has @n_words words (end word not included). Return false to
+// stop.
+typedef bool (*ScanCallback)(long long end, Index n_words, Data data,
+                             void *arg);
+
+// Called with every key found by for_each_prefix(). @words is borrowed from
+// trie and valid only during the call. Return false to stop.
+typedef bool (*PrefixCallback)(const Word words[], Index n_words, Data data,
+                               void *arg);
+
+// Called with every key found by fuzzy_search(), which is @n_edits edits
+// away from the query. @words is borrowed as in PrefixCallback.
+typedef bool (*FuzzyCallback)(const Word words[], Index n_words, Index n_edits,
+                              Data data, void *arg);
+
+// Counts of what insert() and erase() did inside trie, to tell why they are
+// slow on some keys. They are counted only if trie.cpp is built with
+// TRIE_STATS, which costs a little time; @enabled is false otherwise.
+struct TrieStats {
+    bool enabled;
+    long long collisions;        // sub node cell taken by another node
+    long long relocations;       // sub nodes moved to a new base
+    long long relocated_nodes;   // sub nodes moved by relocations
+    long long find_bases;        // bases looked for
+    long long base_probes;       // free cells tried as bases
+    long long base_fallbacks;    // bases put past all cells in use
+    long long node_growths;      // double array grown
+    long long tail_growths;      // tails grown
+    long long tail_word_growths; // tail words grown
+    long long tail_splits;       // tails cut where a new key branches off
+};
+
+// Where the memory of trie goes. Bytes are what trie asked for; headers and
+// rounding of the allocator are not included. It costs no scan of trie, so
+// it can be polled as a metric.
+struct MemoryUsage {
+    Index n_nodes;                // cells of the double array
+    Index n_used_nodes;           // cells used by nodes, except root
+    Index n_tails;                // tail slots
+    Index n_used_tails;           // tail slots used by keys
+    Index n_tail_words;           // tail words allocated
+    Index n_used_tail_words;      // tail words in use, garbage included
+    Index n_garbage_tail_words;   // tail words left by erased or split tails
+    Index n_shared_tail_words;    // tail words saved by compact()
+    long long node_bytes;         // cells with their max data and siblings
+    long long block_bytes;        // free cell lists
+    long long tail_bytes;
+    long long tail_word_bytes;
+    long long index_bytes;        // links, ranks and reversed keys, if built
+    long long unused_bytes;       // free cells, empty tail slots, free and
+                                  // garbage tail words
+    long long total_bytes;
+    double density;               // n_used_nodes / n_nodes
+    double average_tail_words;    // live tail words per key
+    bool mapped;                  // arrays are in an image or shared with
+                                  // snapshots, not in private heap memory
 };
 
 class Trie {
     void *trie;
 
+    friend class PrefixIterator;
+    friend class Cursor;
+
+    explicit Trie(void *trie);
+
 public:
     Trie(void);
     ~Trie(void);
 
-    void insert(const Word words[], Index n_words, Index data=0);
+    void insert(const Word words[], Index n_words, Data data=0);
     void erase(const Word words[], Index n_words);
     // @data returns data correspond to @words stored in trie when @words is found;
     // @unmatch returns the index of the first unmatch word in @words when @words is not found.
-    bool search(const Word words[], Index n_words, Index *data=NULL, Index *unmatch=NULL) const;
-    void prefix(const Word words[], Index n_words, std::vector<Index>& tails) const;
+    bool search(const Word words[], Index n_words, Data *data=NULL, Index *unmatch=NULL) const;
+    // search() for @n keys at a time, which hides memory latency when trie
+    // is much bigger than cache. @found[i] and @data[i] (if found) are the
+    // results of @words[i]. @data can be NULL.
+    void search_batch(const Word *const words[], const Index n_words[],
+                      Index n, Data data[], bool found[]) const;
+    void prefix(const Word words[], Index n_words, std::vector<Data>& tails) const;
     // @tails return all tails begin with @words.
     // Don't forget to free memory in @tails[]->words.
     void prefix(const Word words[], Index n_words, std::vector<Tail>& tails) const;
+    // Call @callback with every key beginning with @words (the whole key,
+    // @words included) in ascending order. Nothing is allocated per key.
+    void for_each_prefix(const Word words[], Index n_words,
+                         PrefixCallback callback, void *arg=NULL) const;
+    // Call @callback with every key within @max_edits insertions, deletions
+    // and substitutions of @words in ascending order. Subtrees which cannot
+    // be within @max_edits are not visited.
+    void fuzzy_search(const Word words[], Index n_words, Index max_edits,
+                      FuzzyCallback callback, void *arg=NULL) const;
+    // Call @callback with at most @k keys beginning with @words, which have
+    // the greatest data, in descending order of data. Only the subtrees which
+    // may hold one of them are visited.
+    void top_k(const Word words[], Index n_words, Index k,
+               PrefixCallback callback, void *arg=NULL) const;
+    bool segment_max_match(const Word words[], Index n_words, Word end_word,
+                           Data *data, Index *unmatch) const;
+    bool segment_min_match(const Word words[], Index n_words, Word end_word,
+                           Data *data, Index *unmatch) const;
+    // Write every key ending with @end_word which is a prefix of @words to
+    // @results, shortest first, in one walk. Write at most @max_results of
+    // them, and return the number of keys found.
+    Index common_prefix_search(const Word words[], Index n_words, Word end_word,
+                               Match results[], Index max_results) const;
+    // Cut UTF-8 @text into keys ending with @end_word (as segment_max_match()
+    // matches them) and single characters, without splitting any character.
+    // Write the first @max_tokens tokens to @tokens in order, in every mode,
+    // and return the number of tokens, which is never more than @n_words.
+    // @tokens is not complete if it returns more than @max_tokens.
+    // Backward and bidirectional matching walk keys reversed, so
+    // build_reversed() should be called first. Bidirectional matching walks
+    // text both ways in one pass, and walks it again only if @tokens has no
+    // room for the tokens of both.
+    Index segment(const Word text[], Index n_words, Word end_word,
+                  SegmentMode mode, Token tokens[], Index max_tokens) const;
+    // Build a second trie of keys ending with @end_word, with the words
+    // before @end_word reversed, for backward segment(). It takes about as
+    // much memory as those keys do in trie. insert() and erase() keep it up
+    // to date, which makes insert() about twice and erase() about three
+    // times as slow; build() and loading an image drop it.
+    void build_reversed(Word end_word);
+    // Build Aho-Corasick failure and output links of keys ending with
+    // @end_word for scan(). insert() and erase() drop them.
+    void build_links(Word end_word);
+    // Report every occurrence of every key in @text to @callback in one pass,
+    // in order of their ends. build_links() should be called first. Pass
+    // the same @state to scan a stream chunk by chunk. Return false if
+    // @callback stops it.
+    bool scan(const Word text[], Index n_words, ScanCallback callback,
+              void *arg=NULL, ScanState *state=NULL) const;
+    // A handle of key @words, which stays the same while the key is in trie,
+    // or -1 if it is not. Handles of erased keys may be reused by new keys,
+    // and compact_storage() changes all handles.
+    Index handle(const Word words[], Index n_words) const;
+    // Write the key of @handle to @words (at most @max_words of it) and its
+    // data to @data, as key_at() does. Return -1 if @handle is not in use.
+    Index key_of(Index handle, Word words[], Index max_words,
+                 Data *data=NULL) const;
+    // Number every key by its place in ascending order from 0, for rank()
+    // and key_at(). insert() and erase() drop the numbers.
+    void build_ranks(void);
+    // The number of the key @words, or -1 if it is not in trie.
+    Index rank(const Word words[], Index n_words) const;
+    // Write key number @ordinal to @words (at most @max_words of it) and its
+    // data to @data. Return the number of words in the key, or -1 if there
+    // is no such key.
+    Index key_at(Index ordinal, Word words[], Index max_words,
+                 Data *data=NULL) const;
+    // Replace trie by @n_keys keys, which should be sorted in ascending order
+    // and distinguishable. It is much faster than insert() one by one and
+    // leaves a denser double array.
+    void build(const Word *const keys[], const Index n_words[],
+               const Data data[], Index n_keys);
+    // Let tails which end with the same words share them, which saves memory
+    // for big dictionaries. Data of every key is kept. Later changes to trie
+    // may copy shared words again, so call it after bulk changes.
+    void compact(void);
+    // Give back memory which erase() leaves behind: free the nodes left
+    // without keys, move nodes to the front of the double array and tails to
+    // the front of their table, and shrink both. Data of every key is kept,
+    // but handles, cursors, links and ranks are not. Sub nodes which fit in
+    // no free cells before them stay, so another pass may free more. If
+    // @max_steps is not 0, stop after about that many cells and tails are
+    // visited or moved, and return false; the next call goes on from there.
+    // Return true when the pass is done.
+    bool compact_storage(Index max_steps=0);
+    // Make room for @n_keys keys of @n_words words in all, end words
+    // included, so inserting them grows no array. The double array may still
+    // grow if free cells between nodes outnumber the words kept in tails.
+    void reserve(Index n_keys, Index n_words);
+    // Arrays grow to @factor times their size, and by @chunk entries at
+    // least. It is 2 and 0 by default. A factor of 1 grows by fixed chunks.
+    // Throw invalid_argument if @factor is less than 1 or @chunk is negative.
+    void set_growth(double factor, Index chunk=0);
+    // Used cells / allocated cells of the double array.
+    double density(void) const;
+    // Counts since trie was created, built or opened.
+    TrieStats stats(void) const;
+    MemoryUsage memory_usage(void) const;
+    // Write trie to an image file at @path, which can be used by open_mapped().
+    bool save(const char *path) const;
+    // Replace trie by the image at @path. The image is mapped read-only and
+    // used without any copy, so all processes opening the same image share
+    // one copy of it in page cache. insert() and erase() throw logic_error
+    // after it succeeds. Return false if @path is not a valid image.
+    bool open_mapped(const char *path);
+    // Return a read-only copy of trie, which shares all memory with trie and
+    // costs no copy. Later insert() and erase() on trie copy only the pages
+    // they change. Delete the snapshot when it is no longer needed.
+    Trie *snapshot(void);
+};
+
+// Walk through all keys beginning with @words in trie in ascending order,
+// like Trie::for_each_prefix(). Key buffer is reused, so @words returned by
+// next() is valid until the next call. Trie should not be changed while
+// walking.
+class PrefixIterator {
+    void *iter;
+
+public:
+    PrefixIterator(const Trie& trie, const Word words[], Index n_words);
+    ~PrefixIterator(void);
+
+    bool next(const Word **words, Index *n_words, Data *data);
+};
+
+// A position at one key of trie, which moves both ways in ascending order of
+// keys, or at the end, past the last key. Only keys in the range given by
+// range() are reached, all keys by default. Moves cost a few nodes, not a
+// walk of whole subtrees. Trie should not be changed while it is used.
+class Cursor {
+    void *cursor;
+
+public:
+    // At the end.
+    explicit Cursor(const Trie& trie);
+    ~Cursor(void);
+
+    // Limit cursor to keys in [@begin, @end) and move to the first of them.
+    // NULL @end for no upper limit.
+    bool range(const Word begin[], Index n_begin, const Word end[], Index n_end);
+    // Move to the first key not less than (lower_bound()) or greater than
+    // (upper_bound()) @words. These and all moves below return false and move
+    // to the end if there is no such key.
+    bool lower_bound(const Word words[], Index n_words);
+    bool upper_bound(const Word words[], Index n_words);
+    bool first(void);
+    bool last(void);
+    // next() stays at the end, and prev() at the end moves to the last key.
+    bool next(void);
+    bool prev(void);
+    // Key and data at cursor. Key buffer is reused, so @words is valid until
+    // the next move. Return false at the end.
+    bool get(const Word **words, Index *n_words, Data *data) const;
+};
+
+// Trie for many reader threads and one writer thread. Readers never lock and
+// never wait: they read the version of trie published last. The writer
+// changes its own version by insert() and erase(), which readers see after
+// publish(). Only the writer thread may call insert(), erase() and publish().
+class ConcurrentTrie {
+    void *trie;
+
+public:
+    ConcurrentTrie(void);
+    ~ConcurrentTrie(void);
+
+    void insert(const Word words[], Index n_words, Data data=0);
+    void erase(const Word words[], Index n_words);
+    bool compact_storage(Index max_steps=0);
+    // As Trie::build_reversed(), for segment() of versions published since.
+    void build_reversed(Word end_word);
+    // Make all changes visible to readers. Versions replaced by it are freed
+    // once the readers which may be reading them are done.
+    void publish(void);
+
+    bool search(const Word words[], Index n_words, Data *data=NULL, Index *unmatch=NULL) const;
+    void search_batch(const Word *const words[], const Index n_words[],
+                      Index n, Data data[], bool found[]) const;
+    void prefix(const Word words[], Index n_words, std::vector<Data>& tails) const;
+    void prefix(const Word words[], Index n_words, std::vector<Tail>& tails) const;
+    void for_each_prefix(const Word words[], Index n_words,
+                         PrefixCallback callback, void *arg=NULL) const;
+    void top_k(const Word words[], Index n_words, Index k,
+               PrefixCallback callback, void *arg=NULL) const;
+    void fuzzy_search(const Word words[], Index n_words, Index max_edits,
+                      FuzzyCallback callback, void *arg=NULL) const;
     bool segment_max_match(const Word words[], Index n_words, Word end_word,
-                           Index *data, Index *unmatch) const;
+                           Data *data, Index *unmatch) const;
     bool segment_min_match(const Word words[], Index n_words, Word end_word,
-                           Index *data, Index *unmatch) const;
+                           Data *data, Index *unmatch) const;
+    Index common_prefix_search(const Word words[], Index n_words, Word end_word,
+                               Match results[], Index max_results) const;
+    Index segment(const Word text[], Index n_words, Word end_word,
+                  SegmentMode mode, Token tokens[], Index max_tokens) const;
+    Index handle(const Word words[], Index n_words) const;
+    Index key_of(Index handle, Word words[], Index max_words,
+                 Data *data=NULL) const;
 };
 
 #endif